@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "parser.hpp"
+
+// Execution encoding of the optimized program used by bfi. Every
+// Instruction maps to exactly one fixed size Op at the same index, so jump
+// offsets and profile counts carry over unchanged. Multiplier references of
+// INCR are either inlined (single reference) or stored in one contiguous
+// operand pool shared by the whole program.
+struct Op {
+	Inst_Codes code = NO_OP;
+	std::uint8_t nRefs = 0;
+	std::int32_t lRef = 0;
+	std::int32_t value = 0;
+	// the reference itself if nRefs == 1, else start of refs in operand pool,
+	// or of the constants of a BLOCK or SWEEP
+	std::int32_t ref = 0;
+};
+
+static_assert(sizeof(Op) == 16, "Op should stay a packed 16 byte record");
+
+struct ByteCode {
+	std::vector<Op> ops;
+	std::vector<std::int32_t> operands;
+	// scratch slots needed by the largest LINEAR, slot k belongs to member k
+	std::size_t scratch = 0;
+
+	[[nodiscard]] auto refs(const Op& op) const {
+		return std::span<const std::int32_t>(
+			operands.data() + op.ref, op.nRefs);
+	}
+};
+
+constexpr auto MAX_REFS = std::numeric_limits<std::uint8_t>::max();
+
+// Rows of BLOCK constants are padded to a multiple of this many cells, so
+// they hold whole 16 byte vectors of any cell width
+constexpr auto BLOCK_PADDING = 16;
+
+// Constants of the window of cells a BLOCK covers, from its first member's
+// cell to its last one's: each member's value at its cell and 0 elsewhere.
+// For SET_C a second row has 0 at the members and -1 at the cells they keep.
+void blockConstants(
+	std::span<const Instruction> members, std::vector<std::int32_t>& pool) {
+	const auto start = members.front().lRef;
+	const auto size = members.back().lRef - start + 1;
+	const auto padded =
+		(size + BLOCK_PADDING - 1) / BLOCK_PADDING * BLOCK_PADDING;
+	const auto values = pool.size();
+	pool.resize(values + padded, 0);
+	for (const auto& m : members) { pool[values + m.lRef - start] = m.value; }
+	if (members.front().code != SET_C) { return; }
+	const auto keep = pool.size();
+	pool.resize(keep + padded, -1);
+	for (const auto& m : members) { pool[keep + m.lRef - start] = 0; }
+}
+
+// Constants of a SWEEP by `stride`, as a row of masks of the cells to keep
+// followed by a row of values to add. Entry k of a row is for the cells
+// k, k + |stride|.. of the window the SWEEP changes, which starts at the
+// tested cell if it moves right and past the cell it stops at otherwise.
+// Each row repeats its period for another BLOCK_PADDING cells, so a vector
+// can be read from any entry of the first period.
+void sweepConstants(
+	std::span<const Instruction> members, int stride,
+	std::vector<std::int32_t>& pool) {
+	const auto period = std::abs(stride);
+	const auto first = stride > 0 ? 0 : stride + 1;
+	const auto keep = pool.size(), add = keep + period + BLOCK_PADDING;
+	pool.resize(add + period + BLOCK_PADDING, 0);
+	std::fill(pool.begin() + keep, pool.begin() + add, -1);
+	for (const auto& m : members) {
+		for (auto k = m.lRef - first; k < period + BLOCK_PADDING; k += period) {
+			pool[keep + k] = m.code == SET_C ? 0 : -1;
+			pool[add + k] = m.value;
+		}
+	}
+}
+
+ByteCode lower(std::span<const Instruction> code) {
+	ByteCode bc;
+	bc.ops.reserve(code.size());
+	for (const auto& inst : code) {
+		if (inst.rRef.size() > MAX_REFS) {
+			throw std::runtime_error(
+				"Too many references in instruction for bytecode");
+		}
+		Op op{
+			.code = inst.code,
+			.nRefs = static_cast<std::uint8_t>(inst.rRef.size()),
+			.lRef = inst.lRef,
+			.value = inst.value,
+			.ref = 0};
+		if (op.nRefs == 1) {
+			op.ref = inst.rRef.front();
+		} else if (op.nRefs > 1) {
+			op.ref = static_cast<std::int32_t>(bc.operands.size());
+			bc.operands.insert(
+				bc.operands.end(), inst.rRef.begin(), inst.rRef.end());
+		}
+		if (op.code == LINEAR) {
+			bc.scratch = std::max(bc.scratch, std::size_t(op.value));
+		}
+		if (op.code == BLOCK) {
+			op.ref = static_cast<std::int32_t>(bc.operands.size());
+			blockConstants(std::span(&inst + 1, inst.value), bc.operands);
+		}
+		if (op.code == SWEEP) {
+			op.ref = static_cast<std::int32_t>(bc.operands.size());
+			sweepConstants(
+				std::span(&inst + 1, inst.value), inst.lRef, bc.operands);
+		}
+		bc.ops.push_back(op);
+	}
+	return bc;
+}
+
+// Profiling policies of the engines. Both engines are templated on one of
+// these, so a run without -p carries no counters at all.
+struct NoProfile {
+	explicit NoProfile(const ByteCode&) {}
+	void enterLoop(std::size_t) {}
+	void backEdge(std::size_t) {}
+};
+
+// Counts only how often a loop body is entered from its JUMP_C and how often
+// its JUMP_O jumps back. Everything else runs as often as the straight line
+// code around it, so per instruction counts are rebuilt from these two.
+class Profile {
+	std::vector<std::uint64_t> entries, backEdges;
+
+   public:
+	explicit Profile(const ByteCode& bc)
+		: entries(bc.ops.size(), 0), backEdges(bc.ops.size(), 0) {}
+	void enterLoop(std::size_t i) { entries[i]++; }
+	void backEdge(std::size_t i) { backEdges[i]++; }
+
+	[[nodiscard]] std::vector<std::uint64_t> counts(const ByteCode& bc) const {
+		const auto& code = bc.ops;
+		std::vector<std::uint64_t> count(code.size(), 0);
+		std::vector<std::uint64_t> stack;
+		std::uint64_t current = 1;
+		for (auto i = 0u; i < code.size(); ++i) {
+			count[i] = current;
+			if (code[i].code == JUMP_C) {
+				stack.push_back(current);
+				current = entries[i] + backEdges[i + code[i].value];
+			} else if (code[i].code == JUMP_O) {
+				current = stack.back();
+				stack.pop_back();
+			}
+		}
+		return count;
+	}
+};
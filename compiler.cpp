@@ -15,29 +15,266 @@
 #include <llvm/TargetParser/Host.h>
 
 #include <filesystem>
+#include <limits>
 
+#include "io.hpp"
 #include "parser.hpp"
+#include "tape.hpp"
 #include "util.hpp"
 
+// Width in bytes of the vectors SCAN is compiled to, 0 for scalar code
+int vectorBytes(ISA isa) {
+	switch (isa) {
+		case ISA::AVX512BW:
+			return 64;
+		case ISA::AVX2:
+			return 32;
+		case ISA::SSE2:
+			return 16;
+		case ISA::NATIVE:
+		case ISA::SCALAR:
+			break;
+	}
+	return 0;
+}
+
 namespace manual {
-	int mod(int v) {
-		constexpr int MAX = std::numeric_limits<DATA_TYPE>::max();
-		constexpr int MOD = MAX + 1;
-		while (v < MOD) { v += MOD; }
-		return v & MAX;
+	template <CellType Cell> std::int64_t mod(std::int64_t v) {
+		return static_cast<Cell>(v);
 	}
 
-	void scan(std::ofstream& output, const Instruction& inst, auto loc = 0u) {
+	// How a cell of the tape is spelled in Intel syntax. r12 holds the
+	// start of the tape and rbx the index of the current cell.
+	template <CellType Cell> struct CellAsm {
+		static constexpr int SIZE = sizeof(Cell);
+		static constexpr std::string_view PTR = SIZE == 1	? "BYTE PTR"
+												: SIZE == 2 ? "WORD PTR"
+															: "DWORD PTR";
+		// low part of eax and ecx holding a cell
+		static constexpr std::string_view AX = SIZE == 1	? "al"
+											   : SIZE == 2 ? "ax"
+														   : "eax";
+		static constexpr std::string_view CX = SIZE == 1	? "cl"
+											   : SIZE == 2 ? "cx"
+														   : "ecx";
+		// zero extending load of a cell into a 32 bit register
+		static constexpr std::string_view LOAD = SIZE == 4 ? "mov" : "movzx";
+		// vpcmp variant comparing vectors of cells
+		static constexpr std::string_view VPCMP = SIZE == 1	  ? "vpcmpb"
+												  : SIZE == 2 ? "vpcmpw"
+															  : "vpcmpd";
+		// pcmpeq suffix for cells of SSE2 and AVX2 compares
+		static constexpr std::string_view SUFFIX = SIZE == 1	? "b"
+												   : SIZE == 2 ? "w"
+															   : "d";
+
+		// cells per AVX-512 vector and the registers their one bit per cell
+		// masks are rotated in
+		static constexpr int VEC_SZ = 64 / SIZE;
+		static constexpr std::string_view MASK_AX = SIZE == 1	? "rax"
+													: SIZE == 2 ? "eax"
+																: "ax";
+		static constexpr std::string_view MASK_DX = SIZE == 1	? "rdx"
+													: SIZE == 2 ? "edx"
+																: "dx";
+		static constexpr std::string_view KMOV = SIZE == 1	 ? "kmovq k1, rax"
+												 : SIZE == 2 ? "kmovd k1, eax"
+															 : "kmovw k1, eax";
+
+		static std::string at(int offset = 0) {
+			return std::string(PTR) + " [r12+rbx*" + std::to_string(SIZE) +
+				   "+" + std::to_string(offset * SIZE) + "]";
+		}
+		static std::string temp(int slot) {
+			return std::string(PTR) + " temp[" + std::to_string(slot * SIZE) +
+				   "]";
+		}
+	};
+
+	// Scalar end of a vector SCAN, checks cells from rbx on one `jump` at a
+	// time. It runs off the tape into a guard like any other pointer move.
+	template <CellType Cell>
+	void scanTail(std::ofstream& output, int jump, auto loc) {
+		using A = CellAsm<Cell>;
+		print(output, ".SCAN_SLOW%:", loc);
+		print(output, "	cmp %, 0", A::at());
+		print(output, "	je .SCAN_END%", loc);
+		print(output, "	add rbx, %", jump);
+		print(output, "	jmp .SCAN_SLOW%", loc);
+		print(output, ".SCAN_END%:", loc);
+	}
+
+	// SCAN with SSE2 or AVX2, which only report zero bytes. Cell k of a
+	// vector owns bits k*SIZE.. of pmovmskb's result, all of them set when
+	// it is zero, so the visited cells are marked by their lowest bit.
+	// A vector that would reach past the tape sends the scan back to where
+	// it started in rsi, and scanTail finishes it.
+	template <CellType Cell>
+	void movemaskScan(
+		std::ofstream& output, int jump, bool isNeg, int bytes, auto loc) {
+		using A = CellAsm<Cell>;
+		const auto lanes = bytes / A::SIZE;
+		const auto sign = isNeg ? -1 : 1;
+		const auto isPowerOf2 = (jump & (jump - 1)) == 0;
+		const auto shift = jump - (lanes % jump);
+		const auto isAvx2 = bytes == 32;
+
+		std::uint64_t visited = 0;
+		for (auto i = 0; i < lanes; i += jump) { visited |= 1ULL << i; }
+		if (isNeg) { visited = revBits(visited) >> (64 - lanes); }
+		std::uint64_t mask = 0;
+		for (auto i = 0; i < lanes; ++i) {
+			if ((visited >> i & 1) != 0) { mask |= 1ULL << (i * A::SIZE); }
+		}
+
+		print(output, "#Scan of %", sign * jump);
+		print(output, "	mov rsi, rbx");
+		if (isNeg) { print(output, "	add rbx, %", -lanes + 1); }
+
+		print(output, "	mov eax, %", mask);
+		if (isAvx2) {
+			print(output, "	vpxor ymm0, ymm0, ymm0");
+		} else {
+			print(output, "	pxor xmm0, xmm0");
+		}
+		print(output, "	add rbx, %", -sign * lanes);
+		print(output, ".SCAN_START%:", loc);
+		print(output, "	add rbx, %", sign * lanes);
+		print(output, "	cmp rbx, %", TAPE_LENGTH - lanes);
+		print(output, "	ja .SCAN_TAIL%", loc);
+		if (isAvx2) {
+			print(
+				output, "	vpcmpeq% ymm1, ymm0, YMMWORD PTR [r12+rbx*%]",
+				A::SUFFIX, A::SIZE);
+			print(output, "	vpmovmskb ecx, ymm1");
+		} else {
+			print(output, "	movdqu xmm1, XMMWORD PTR [r12+rbx*%]", A::SIZE);
+			print(output, "	pcmpeq% xmm1, xmm0", A::SUFFIX);
+			print(output, "	pmovmskb ecx, xmm1");
+		}
+		print(output, "	and ecx, eax");
+
+		if (!isPowerOf2) {
+			// rotate the mask within the `bytes` bits of the vector
+			const auto* ax = isAvx2 ? "eax" : "ax";
+			const auto* dx = isAvx2 ? "edx" : "dx";
+			print(output, "	mov edx, eax");
+			print(output, "	% %, %", isNeg ? "shr" : "shl", dx, shift * A::SIZE);
+			print(
+				output, "	% %, %", isNeg ? "shl" : "shr", ax,
+				(jump - shift) * A::SIZE);
+			print(output, "	or %, %", ax, dx);
+		}
+
+		print(output, "	test ecx, ecx");
+		print(output, "	je .SCAN_START%", loc);
+		if (isAvx2) { print(output, "	vzeroupper"); }
+
+		print(output, "	% ecx, ecx", isNeg ? "bsr" : "bsf");
+		if (A::SIZE > 1) {
+			print(output, "	shr ecx, %", std::countr_zero(0u + A::SIZE));
+		}
+		print(output, "	add rbx, rcx");
+		print(output, "	jmp .SCAN_END%", loc);
+		print(output, ".SCAN_TAIL%:", loc);
+		if (isAvx2) { print(output, "	vzeroupper"); }
+		print(output, "	mov rbx, rsi");
+		scanTail<Cell>(output, sign * jump, loc);
+	}
+
+	// SCAN for jumps too large for a vector to hold a full period. Lane k of
+	// a gather loads 32 bits at the kth cell visited, narrower cells drop the
+	// bits of their neighbours before the compare. Gathers that would reach
+	// past the tape are left to scanTail.
+	template <CellType Cell>
+	void stridedScan(std::ofstream& output, int jump, int bytes, auto loc) {
+		using A = CellAsm<Cell>;
+		const auto lanes = bytes / 4;
+		const auto isAvx512 = bytes == 64;
+		// cells covered by the 32 bit load of a lane
+		const auto width = 4 / A::SIZE;
+		const auto reach = (lanes - 1) * jump;
+		const auto low = std::min(0, reach);
+		const auto high = std::max(0, reach) + width;
+
+		print(output, "#Strided scan of %", jump);
+		print(output, ".section .rodata");
+		print(output, "	.align %", bytes);
+		print(output, ".STRIDES%:", loc);
+		for (auto k = 0; k < lanes; ++k) {
+			print(output, "	.long %", k * jump * A::SIZE);
+		}
+		print(output, ".text");
+
+		print(
+			output, "	mov eax, %",
+			static_cast<std::uint32_t>(std::numeric_limits<Cell>::max()));
+		if (isAvx512) {
+			print(output, "	vmovdqu32 zmm2, ZMMWORD PTR .STRIDES%", loc);
+			print(output, "	vpbroadcastd zmm3, eax");
+		} else {
+			print(output, "	vmovdqu ymm2, YMMWORD PTR .STRIDES%", loc);
+			print(output, "	vmovd xmm3, eax");
+			print(output, "	vpbroadcastd ymm3, xmm3");
+			print(output, "	vpxor ymm5, ymm5, ymm5");
+		}
+		print(output, "	add rbx, %", -lanes * jump);
+		print(output, ".SCAN_START%:", loc);
+		print(output, "	add rbx, %", lanes * jump);
+		// one unsigned compare tests both ends of the tape
+		print(output, "	lea rcx, [rbx+%]", low);
+		print(output, "	cmp rcx, %", TAPE_LENGTH - (high - low));
+		print(output, "	ja .SCAN_TAIL%", loc);
+		print(output, "	lea rsi, [r12+rbx*%]", A::SIZE);
+		if (isAvx512) {
+			print(output, "	kxnorw k1, k1, k1");
+			print(output, "	vpgatherdd zmm1{k1}, DWORD PTR [rsi+zmm2]");
+			print(output, "	vptestnmd k0, zmm1, zmm3");
+			print(output, "	kortestw k0, k0");
+			print(output, "	je .SCAN_START%", loc);
+			print(output, "	kmovw ecx, k0");
+		} else {
+			print(output, "	vpcmpeqd ymm4, ymm4, ymm4");
+			print(output, "	vpgatherdd ymm1, DWORD PTR [rsi+ymm2], ymm4");
+			print(output, "	vpand ymm1, ymm1, ymm3");
+			print(output, "	vpcmpeqd ymm1, ymm1, ymm5");
+			print(output, "	vmovmskps ecx, ymm1");
+			print(output, "	test ecx, ecx");
+			print(output, "	je .SCAN_START%", loc);
+			print(output, "	vzeroupper");
+		}
+		print(output, "	bsf ecx, ecx");
+		print(output, "	imul rcx, rcx, %", jump);
+		print(output, "	add rbx, rcx");
+		print(output, "	jmp .SCAN_END%", loc);
+		print(output, ".SCAN_TAIL%:", loc);
+		if (!isAvx512) { print(output, "	vzeroupper"); }
+		scanTail<Cell>(output, jump, loc);
+	}
+
+	template <CellType Cell>
+	void scan(
+		std::ofstream& output, const Instruction& inst, const Args& args,
+		auto loc = 0u) {
+		using A = CellAsm<Cell>;
 		auto jump = inst.value;
 		if (jump == 0) { return; }
 
-		// For large jump, normal scan works fine
+		// The vector scans need every vector to hold a full period of the
+		// jump, larger jumps gather when there is a gather instruction
 		constexpr auto LARGE_JUMP = 16;
-		if (std::abs(jump) >= LARGE_JUMP) {
+		const auto lanes = vectorBytes(args.isa) / A::SIZE;
+		const auto canGather =
+			args.isa == ISA::AVX512BW || args.isa == ISA::AVX2;
+		if (std::abs(jump) >= LARGE_JUMP || std::abs(jump) > lanes) {
+			if (canGather) {
+				stridedScan<Cell>(output, jump, vectorBytes(args.isa), loc);
+				return;
+			}
 			print(output, "	add rbx, %", -jump);
 			print(output, ".SCAN_START%:", loc);
 			print(output, "	add rbx, %", jump);
-			print(output, "	cmp BYTE PTR tape[rbx], 0");
+			print(output, "	cmp %, 0", A::at());
 			print(output, "	jne .SCAN_START%", loc);
 			print(output, ".SCAN_END%:", loc);
 			return;
@@ -48,42 +285,53 @@ namespace manual {
 		if (isNeg) { jump = -jump; }
 		auto isPowerOf2 = (jump & (jump - 1)) == 0;
 
-		const auto VEC_SZ = 64;
+		if (args.isa != ISA::AVX512BW) {
+			movemaskScan<Cell>(output, jump, isNeg, vectorBytes(args.isa), loc);
+			return;
+		}
+
+		const auto VEC_SZ = A::VEC_SZ;
 		const auto shift = jump - (static_cast<int>(VEC_SZ) % jump);
 
-		__mmask64 mask = 0;
-		for (auto i = 0u; i < VEC_SZ; i += jump) { mask = mask | 1ULL << i; }
-		if (isNeg) { mask = revBits(mask); }
+		std::uint64_t mask = 0;
+		for (auto i = 0; i < VEC_SZ; i += jump) { mask = mask | 1ULL << i; }
+		if (isNeg) { mask = revBits(mask) >> (64 - VEC_SZ); }
 
 		print(output, "#Scan of %", sign * jump);
-		// Generate instructions
+		// Generate instructions, rsi keeps the start for the scalar tail
+		print(output, "	mov rsi, rbx");
 		if (isNeg) { print(output, "	add rbx, %", -VEC_SZ + 1); }
 
 		print(output, "	mov rax, %", mask);
-		print(output, "	kmovq k1, rax");
+		print(output, "	%", A::KMOV);
 
 		print(output, "	vpxorq zmm0, zmm0, zmm0");
 		print(output, "	add rbx, %", -sign * VEC_SZ);
 		print(output, ".SCAN_START%:", loc);
 		print(output, "	add rbx, %", sign * VEC_SZ);
-		print(output, "	vmovdqu64 zmm1, ZMMWORD PTR tape[rbx]");
+		print(output, "	cmp rbx, %", TAPE_LENGTH - VEC_SZ);
+		print(output, "	ja .SCAN_TAIL%", loc);
+		print(output, "	vmovdqu64 zmm1, ZMMWORD PTR [r12+rbx*%]", A::SIZE);
 
-		print(output, "	vpcmpb k0 {k1}, zmm0, zmm1, 0");
+		print(output, "	% k0 {k1}, zmm0, zmm1, 0", A::VPCMP);
 
 		if (!isPowerOf2) {
+			// rotate the mask within VEC_SZ bits
+			const auto ax = A::MASK_AX;
+			const auto dx = A::MASK_DX;
 			if (isNeg) {
 				print(output, "	mov rdx, rax");
-				print(output, "	shr rdx, %", shift);
-				print(output, "	shl rax, %", jump - shift);
-				print(output, "	or rax, rdx");
-				print(output, "	kmovq k1, rax");
+				print(output, "	shr %, %", dx, shift);
+				print(output, "	shl %, %", ax, jump - shift);
+				print(output, "	or %, %", ax, dx);
+				print(output, "	%", A::KMOV);
 
 			} else {
 				print(output, "	mov rdx, rax");
-				print(output, "	shl rdx, %", shift);
-				print(output, "	shr rax, %", jump - shift);
-				print(output, "	or rax, rdx");
-				print(output, "	kmovq k1, rax");
+				print(output, "	shl %, %", dx, shift);
+				print(output, "	shr %, %", ax, jump - shift);
+				print(output, "	or %, %", ax, dx);
+				print(output, "	%", A::KMOV);
 			}
 		}
 
@@ -92,43 +340,267 @@ namespace manual {
 
 		print(output, "	kmovq   rax, k0");
 		if (isNeg) {
-			print(output, "	rep bsr rdx, rax");
+			print(output, "	lzcnt rdx, rax");
 		} else {
 			print(output, "	rep bsf rdx, rax");
 		}
 		if (isNeg) {
-			print(output, "	add rbx, %", VEC_SZ - 1);
+			// lzcnt counts from bit 63 whatever the vector length
+			print(output, "	add rbx, 63");
 			print(output, "	sub rbx, rdx");
 		} else {
 			print(output, "	add rbx, rdx");
 		}
+		print(output, "	jmp .SCAN_END%", loc);
+		print(output, ".SCAN_TAIL%:", loc);
+		print(output, "	mov rbx, rsi");
+		scanTail<Cell>(output, sign * jump, loc);
 	}
 
+	// The SWEEP's scan leaves rbx where it stops, then the members run for
+	// every cell it passed with rdi walking from where it started
+	template <CellType Cell>
+	void sweep(
+		std::ofstream& output, const Instruction& header,
+		std::span<Instruction> members, const Args& args, auto loc = 0u) {
+		using A = CellAsm<Cell>;
+		print(output, "	mov rdi, rbx");
+		scan<Cell>(output, {SCAN, 0, header.lRef, {}}, args, loc);
+		print(output, ".SWEEP_START%:", loc);
+		print(output, "	cmp rdi, rbx");
+		print(output, "	je .SWEEP_END%", loc);
+		for (const auto& m : members) {
+			const auto dest = std::string(A::PTR) + " [r12+rdi*" +
+							  std::to_string(A::SIZE) + "+" +
+							  std::to_string(m.lRef * A::SIZE) + "]";
+			if (m.code == SET_C) {
+				print(output, "	mov %, %", dest, mod<Cell>(m.value));
+			} else {
+				print(output, "	mov eax, %", mod<Cell>(m.value));
+				print(output, "	add %, %", dest, A::AX);
+			}
+		}
+		print(output, "	add rdi, %", header.lRef);
+		print(output, "	jmp .SWEEP_START%", loc);
+		print(output, ".SWEEP_END%:", loc);
+	}
+
+	template <CellType Cell>
 	void compileIncr(
 		std::ofstream& output, const std::string& dest,
 		const Instruction& inst) {
+		using A = CellAsm<Cell>;
 		if (inst.rRef.empty()) {
-			print(output, "	mov eax, %", mod(inst.value));
-			print(output, "	add BYTE PTR %, al", dest);
+			print(output, "	mov eax, %", mod<Cell>(inst.value));
+			print(output, "	add %, %", dest, A::AX);
 			return;
 		}
 		auto i = 0u;
 		if (inst.value == 1 || inst.value == -1) {
-			print(output, "	movzx eax, BYTE PTR tape[rbx+%]", inst.rRef[i++]);
+			print(output, "	% eax, %", A::LOAD, A::at(inst.rRef[i++]));
 		} else {
 			print(output, "	mov eax, %", inst.value);
 		}
 		for (; i < inst.rRef.size(); ++i) {
-			print(output, "	movzx ecx, BYTE PTR tape[rbx+%]", inst.rRef[i]);
+			print(output, "	% ecx, %", A::LOAD, A::at(inst.rRef[i]));
 			print(output, "	imul eax, ecx");
 		}
 		if (inst.value == -1) {
-			print(output, "	sub BYTE PTR %, al", dest);
+			print(output, "	sub %, %", dest, A::AX);
 		} else {
-			print(output, "	add BYTE PTR %, al", dest);
+			print(output, "	add %, %", dest, A::AX);
+		}
+	}
+
+	// Every member reads the tape as it was before the LINEAR, so the new
+	// value of each target cell is built in its own temp slot and only
+	// stored back once all of them are computed. Slots are fixed here.
+	template <CellType Cell>
+	auto linear(std::ofstream& output, std::span<Instruction> members) {
+		using A = CellAsm<Cell>;
+		std::map<int, int> slots;
+		for (const auto& m : members) {
+			if (slots.contains(m.lRef)) { continue; }
+			const auto slot = static_cast<int>(slots.size());
+			slots[m.lRef] = slot;
+			print(output, "	% eax, %", A::LOAD, A::at(m.lRef));
+			print(output, "	mov %, %", A::temp(slot), A::AX);
+		}
+		for (const auto& m : members) {
+			auto dest = A::temp(slots[m.lRef]);
+			if (m.code == SET_C) {
+				print(output, "	mov %, %", dest, mod<Cell>(m.value));
+			} else {
+				compileIncr<Cell>(output, dest, m);
+			}
+		}
+		for (const auto& [cell, slot] : slots) {
+			print(output, "	% eax, %", A::LOAD, A::temp(slot));
+			print(output, "	mov %, %", A::at(cell), A::AX);
+		}
+		return slots.size();
+	}
+
+	// Writes WRITE's buffer through write(2), retrying short writes
+	void flushFunction(std::ofstream& output) {
+		output << R"(
+	.type bf_flush, @function
+bf_flush:
+	push rbx
+	xor ebx, ebx
+.FLUSH_LOOP:
+	mov rdx, QWORD PTR outlen
+	sub rdx, rbx
+	jle .FLUSH_END
+	mov edi, 1
+	lea rsi, outbuf[rbx]
+	call write
+	test rax, rax
+	jle .FLUSH_END
+	add rbx, rax
+	jmp .FLUSH_LOOP
+.FLUSH_END:
+	mov QWORD PTR outlen, 0
+	pop rbx
+	ret
+	.size	bf_flush, .-bf_flush
+)";
+	}
+
+	// Returns the next input byte in eax, or -1 at end of input. READ's
+	// buffer is refilled with read(2), flushing pending output first.
+	void readFunction(std::ofstream& output, const Args& args) {
+		output << R"(
+	.type bf_read, @function
+bf_read:
+	sub rsp, 8
+	mov rax, QWORD PTR inpos
+	cmp rax, QWORD PTR inlen
+	jl .READ_BYTE
+)";
+		if (args.bufferedOutput) { print(output, "	call bf_flush"); }
+		print(output, "	xor edi, edi");
+		print(output, "	lea rsi, inbuf");
+		print(output, "	mov edx, %", IO_BUFFER_SIZE);
+		output << R"(	call read
+	test rax, rax
+	jle .READ_EOF
+	mov QWORD PTR inlen, rax
+	xor eax, eax
+.READ_BYTE:
+	movzx ecx, BYTE PTR inbuf[rax]
+	inc rax
+	mov QWORD PTR inpos, rax
+	mov eax, ecx
+	add rsp, 8
+	ret
+.READ_EOF:
+	mov eax, -1
+	add rsp, 8
+	ret
+	.size	bf_read, .-bf_read
+)";
+	}
+
+	template <CellType Cell>
+	void read(
+		std::ofstream& output, const Args& args, int offset, auto loc = 0u) {
+		using A = CellAsm<Cell>;
+		print(output, "	call bf_read");
+		switch (args.eof) {
+			case EOFPolicy::UNCHANGED:
+				print(output, "	test eax, eax");
+				print(output, "	js .READ%", loc);
+				print(output, "	mov %, %", A::at(offset), A::AX);
+				print(output, ".READ%:", loc);
+				break;
+			case EOFPolicy::ZERO:
+				print(output, "	xor ecx, ecx");
+				print(output, "	test eax, eax");
+				print(output, "	cmovs eax, ecx");
+				print(output, "	mov %, %", A::at(offset), A::AX);
+				break;
+			case EOFPolicy::MINUS_ONE:
+				print(output, "	mov %, %", A::at(offset), A::AX);
+				break;
 		}
 	}
 
+	template <CellType Cell>
+	void write(
+		std::ofstream& output, const Args& args, int offset, auto loc = 0u) {
+		using A = CellAsm<Cell>;
+		print(output, "	mov rax, QWORD PTR outlen");
+		print(output, "	% ecx, %", A::LOAD, A::at(offset));
+		print(output, "	mov BYTE PTR outbuf[rax], cl");
+		print(output, "	inc rax");
+		print(output, "	mov QWORD PTR outlen, rax");
+		// unbuffered, every byte is handed to write(2) on its own
+		if (!args.bufferedOutput) {
+			print(output, "	call bf_flush");
+			return;
+		}
+		print(output, "	cmp rax, %", IO_BUFFER_SIZE);
+		print(output, "	jne .WRITE%", loc);
+		print(output, "	call bf_flush");
+		print(output, ".WRITE%:", loc);
+	}
+
+	// Maps the tape between two PROT_NONE guards and points r12 at its
+	// first cell. Jumps to .NO_TAPE if the mapping fails.
+	template <CellType Cell> void mapTape(std::ofstream& output) {
+		print(output, "	xor edi, edi");
+		print(output, "	mov rsi, %", TAPE_MAPPING<Cell>);
+		print(output, "	mov edx, %", PROT_READ | PROT_WRITE);
+		print(
+			output, "	mov ecx, %", MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+		print(output, "	mov r8d, -1");
+		print(output, "	xor r9d, r9d");
+		print(output, "	call mmap");
+		print(output, "	cmp rax, -1");
+		print(output, "	je .NO_TAPE");
+		print(output, "	mov r12, rax");
+		print(output, "	mov rdi, rax");
+		print(output, "	mov esi, %", GUARD_LENGTH);
+		print(output, "	mov edx, %", PROT_NONE);
+		print(output, "	call mprotect");
+		print(output, "	mov rdi, %", TAPE_MAPPING<Cell> - GUARD_LENGTH);
+		print(output, "	add rdi, r12");
+		print(output, "	mov esi, %", GUARD_LENGTH);
+		print(output, "	mov edx, %", PROT_NONE);
+		print(output, "	call mprotect");
+		print(output, "	add r12, %", GUARD_LENGTH);
+		print(output, "	mov edi, %", SIGSEGV);
+		print(output, "	lea rsi, bf_segv");
+		print(output, "	call signal");
+	}
+
+	// SIGSEGV handler. The tape is the only memory the program indexes, so
+	// any fault means the pointer ran into a guard. Pending output is
+	// written out first, bf_flush only calls write(2).
+	void segvFunction(std::ofstream& output, const Args& args) {
+		print(output, ".section .rodata");
+		print(output, ".OOB_MSG:");
+		print(output, "	.ascii \"%\\n\"", OUT_OF_BOUNDS);
+		print(output, ".MMAP_MSG:");
+		print(output, "	.string \"mmap\"");
+		output << R"(.text
+	.type bf_segv, @function
+bf_segv:
+	sub rsp, 8
+)";
+		if (args.bufferedOutput) { print(output, "	call bf_flush"); }
+		output << R"(	mov edi, 2
+	lea rsi, .OOB_MSG
+)";
+		print(output, "	mov edx, %", OUT_OF_BOUNDS.size() + 1);
+		output << R"(	call write
+	mov edi, 1
+	call _exit
+	.size	bf_segv, .-bf_segv
+)";
+	}
+
 	void globalArray(
 		std::ofstream& output, std::string_view name, const auto size = 0u) {
 		print(output, "	.globl %", name);
@@ -139,8 +611,11 @@ namespace manual {
 		print(output, "	.zero %", size);
 	}
 
+	template <CellType Cell>
 	bool compile(
-		std::span<Instruction> code, const std::filesystem::path& path) {
+		std::span<Instruction> code, const std::filesystem::path& path,
+		const Args& args) {
+		using A = CellAsm<Cell>;
 		std::ofstream output(path);
 		output << R"(
 .intel_syntax noprefix
@@ -149,23 +624,18 @@ namespace manual {
 	.globl main
 	.type main, @function
 main:
-	sub rsp, 8
+	push r12
 )";
 
-		constexpr auto TAPE_LENGTH = 1000000u;
+		mapTape<Cell>(output);
 		// I store the current index of tape in register B
 		print(output, "	mov rbx, %", TAPE_LENGTH / 2);
 
-		std::map<int, int> locks;
-		std::vector<int> tempSlots(VARIABLE_LIMIT, 0);
-		std::iota(tempSlots.begin(), tempSlots.end(), 0);
+		std::size_t tempSize = 1;
 
-		auto loc = 0u;
-		for (auto& inst : code) {
-			auto dest = "tape[rbx+" + std::to_string(inst.lRef) + "]";
-			if (locks.contains(inst.lRef)) {
-				dest = "temp[" + std::to_string(locks[inst.lRef]) + "]";
-			}
+		for (auto loc = 0u; loc < code.size(); ++loc) {
+			const auto& inst = code[loc];
+			auto dest = A::at(inst.lRef);
 			switch (inst.code) {
 				case NO_OP:
 					break;
@@ -173,100 +643,94 @@ main:
 					print(output, "	add rbx, %", inst.value);
 					break;
 				case SET_C:
-					print(output, "	mov BYTE PTR %, %", dest, inst.value);
+					print(output, "	mov %, %", dest, mod<Cell>(inst.value));
 					break;
 				case INCR:
-					compileIncr(output, dest, inst);
+					compileIncr<Cell>(output, dest, inst);
 					break;
 				case WRITE:
-					print(output, "	mov rsi, QWORD PTR stdout");
-					print(output, "	movzx edi, BYTE PTR tape[rbx]");
-					print(output, "	call putc");
+					write<Cell>(output, args, inst.lRef, loc);
 					break;
 				case READ:
-					print(output, "	mov rdi, QWORD PTR stdin");
-					print(output, "	call getc");
-					print(output, "	mov BYTE PTR tape[rbx], al");
+					read<Cell>(output, args, inst.lRef, loc);
 					break;
 				case JUMP_C:
-					print(output, "	cmp BYTE PTR tape[rbx], 0");
+					print(output, "	cmp %, 0", A::at());
 					print(output, "	je .LOC%", loc + inst.value);
 					print(output, ".LOC%:", loc);
 					break;
 				case JUMP_O:
 					if (inst.lRef == 0) {
-						print(output, "	cmp BYTE PTR tape[rbx], 0");
+						print(output, "	cmp %, 0", A::at());
 						print(output, "	jne .LOC%", loc + inst.value);
 					}
 					print(output, ".LOC%:", loc);
 					break;
 				case SCAN:
-					scan(output, inst, loc);
+					scan<Cell>(output, inst, args, loc);
+					break;
+				case SWEEP:
+					sweep<Cell>(
+						output, inst, code.subspan(loc + 1, inst.value), args,
+						loc);
+					loc += inst.value;
 					break;
 				case DEBUG:
 				case HALT:
+				// members follow as plain instructions
+				case BLOCK:
 					break;
-				case WRITE_LOCK:
-					if (locks.contains(inst.lRef)) {
-						print(
-							std::cerr, "Inst: %: cell % is already locked", loc,
-							inst.lRef);
-						return false;
-					}
-					locks[inst.lRef] = tempSlots.back();
-					tempSlots.pop_back();
-					print(
-						output, "	movzx eax, BYTE PTR tape[rbx+%]",
-						inst.lRef);
-					print(
-						output, "	mov BYTE PTR temp[%], al",
-						locks[inst.lRef]);
-
-					break;
-				case WRITE_UNLOCK:
-					if (!locks.contains(inst.lRef)) {
-						print(
-							std::cerr, "Inst: %: cell % is not locked", loc,
-							inst.lRef);
-						return false;
-					}
-					print(
-						output, "	movzx eax, BYTE PTR temp[%]",
-						locks[inst.lRef]);
-					print(output, "	mov BYTE PTR tape[rbx+%], al", inst.lRef);
-
-					tempSlots.push_back(locks[inst.lRef]);
-					locks.erase(inst.lRef);
+				case LINEAR:
+					tempSize = std::max(
+						tempSize, linear<Cell>(
+									  output, code.subspan(loc + 1, inst.value)));
+					loc += inst.value;
 					break;
 			}
-			loc++;
 		}
 
+		if (args.bufferedOutput) { print(output, "	call bf_flush"); }
 		output << R"(
 	xor eax, eax
-	add rsp, 8
+	pop r12
+	ret
+.NO_TAPE:
+	lea rdi, .MMAP_MSG
+	call perror
+	mov eax, 1
+	pop r12
 	ret
 	.size	main, .-main
-.bss
 )";
-		globalArray(output, "tape", TAPE_LENGTH);
-		globalArray(output, "temp", VARIABLE_LIMIT);
+		flushFunction(output);
+		readFunction(output, args);
+		segvFunction(output, args);
+		print(output, ".bss");
+		globalArray(output, "temp", tempSize * sizeof(Cell));
+		globalArray(output, "outbuf", IO_BUFFER_SIZE);
+		globalArray(output, "outlen", 8);
+		globalArray(output, "inbuf", IO_BUFFER_SIZE);
+		globalArray(output, "inpos", 8);
+		globalArray(output, "inlen", 8);
 
 		return true;
 	}
 }  // namespace manual
 
 namespace llvm {
-	constexpr auto TAPE_LENGTH = 1000000u;
-	class Compiler {
+	template <CellType Cell> class Compiler {
+		const Args& args;
 		LLVMContext ctx;
 		std::unique_ptr<Module> module;
 		IRBuilder<> builder;
-		IntegerType *Tint8, *Tint32;
-		AllocaInst* tape = nullptr;
+		IntegerType *Tint8, *Tint32, *Tcell;
+		Value* tape = nullptr;
 		AllocaInst* ptr = nullptr;
-		std::map<int, Value*> locks;
 		std::vector<BasicBlock*> blocks;
+		GlobalVariable* outBuf = nullptr;
+		GlobalVariable* outLen = nullptr;
+		Function* flush = nullptr;
+		Function* readByte = nullptr;
 
 		static auto constant(int value, IntegerType* type) {
 			return ConstantInt::get(type, value);
@@ -283,29 +747,367 @@ namespace llvm {
 
 		auto cellAddr(int x) {
 			auto* idx = builder.CreateAdd(ptrValue(), constant(x, Tint32));
-			auto* addr = builder.CreateGEP(Tint8, tape, {idx});
+			auto* addr = builder.CreateGEP(Tcell, tape, {idx});
 			return addr;
 		}
 
-		auto loadCell(auto addr) { return builder.CreateLoad(Tint8, addr); }
+		auto loadCell(auto addr) { return builder.CreateLoad(Tcell, addr); }
 		auto storeCell(auto addr, auto val) {
 			return builder.CreateStore(val, addr);
 		}
 
-		auto cell(int x) {
-			if (locks.contains(x)) { return locks[x]; }
-			return static_cast<Value*>(loadCell(cellAddr(x)));
-		}
+		auto cell(int x) { return static_cast<Value*>(loadCell(cellAddr(x))); }
 
 		void compileIncr(const ::Instruction& i) {
 			if (i.value == 0) { return; }
-			Value* t = constant(i.value, Tint8);
+			Value* t = constant(i.value, Tcell);
 			for (const auto& e : i.rRef) { t = builder.CreateMul(t, cell(e)); }
 			auto* addr = cellAddr(i.lRef);
 			auto* res = builder.CreateAdd(loadCell(addr), t);
 			storeCell(addr, res);
 		}
 
+		// WRITE's buffer and bf_flush, which hands it to write(2) and
+		// retries short writes. Unbuffered WRITEs flush after every byte.
+		void createOutputBuffer() {
+			auto* Tint64 = builder.getInt64Ty();
+			auto* Tbuf = ArrayType::get(Tint8, IO_BUFFER_SIZE);
+			outBuf = new GlobalVariable(
+				*module, Tbuf, false, GlobalValue::InternalLinkage,
+				ConstantAggregateZero::get(Tbuf), "outbuf");
+			outLen = new GlobalVariable(
+				*module, Tint32, false, GlobalValue::InternalLinkage,
+				constant(0, Tint32), "outlen");
+
+			auto write = module->getOrInsertFunction(
+				"write", Tint64, Tint32, PointerType::getUnqual(Tint8), Tint64);
+			flush = Function::Create(
+				FunctionType::get(builder.getVoidTy(), false),
+				Function::InternalLinkage, "bf_flush", module.get());
+
+			auto* entry = BasicBlock::Create(ctx, "", flush);
+			auto* condBlock = BasicBlock::Create(ctx, "", flush);
+			auto* loopBlock = BasicBlock::Create(ctx, "", flush);
+			auto* endBlock = BasicBlock::Create(ctx, "", flush);
+
+			IRBuilder<> b(entry);
+			auto* done = b.CreateAlloca(Tint32);
+			b.CreateStore(constant(0, Tint32), done);
+			b.CreateBr(condBlock);
+
+			b.SetInsertPoint(condBlock);
+			auto* left = b.CreateSub(
+				b.CreateLoad(Tint32, outLen), b.CreateLoad(Tint32, done));
+			b.CreateCondBr(
+				b.CreateICmpSGT(left, constant(0, Tint32)), loopBlock,
+				endBlock);
+
+			b.SetInsertPoint(loopBlock);
+			auto* from = b.CreateLoad(Tint32, done);
+			auto* n = b.CreateCall(
+				write, {constant(1, Tint32),
+						b.CreateInBoundsGEP(
+							Tbuf, outBuf, {constant(0, Tint32), from}),
+						b.CreateZExt(left, Tint64)});
+			b.CreateStore(b.CreateAdd(from, b.CreateTrunc(n, Tint32)), done);
+			b.CreateCondBr(
+				b.CreateICmpSGT(n, ConstantInt::get(Tint64, 0)), condBlock,
+				endBlock);
+
+			b.SetInsertPoint(endBlock);
+			b.CreateStore(constant(0, Tint32), outLen);
+			b.CreateRetVoid();
+		}
+
+		// SIGSEGV handler. The tape is the only memory the program indexes,
+		// so any fault means the pointer ran into a guard. Pending output is
+		// written out first, bf_flush only calls write(2).
+		Function* createSegvHandler() {
+			auto* handler = Function::Create(
+				FunctionType::get(builder.getVoidTy(), {Tint32}, false),
+				Function::InternalLinkage, "bf_segv", module.get());
+			IRBuilder<> b(BasicBlock::Create(ctx, "", handler));
+			b.CreateCall(flush);
+			auto message = std::string(OUT_OF_BOUNDS) + "\n";
+			b.CreateCall(
+				module->getOrInsertFunction(
+					"write", builder.getInt64Ty(), Tint32,
+					PointerType::getUnqual(Tint8), builder.getInt64Ty()),
+				{constant(2, Tint32), b.CreateGlobalStringPtr(message),
+				 b.getInt64(message.size())});
+			b.CreateCall(
+				module->getOrInsertFunction(
+					"_exit", builder.getVoidTy(), Tint32),
+				{constant(1, Tint32)});
+			b.CreateUnreachable();
+			return handler;
+		}
+
+		// Maps the tape between two PROT_NONE guards instead of zeroing it
+		// on the stack, pages are zeroed by the kernel on first touch.
+		// Returns 1 from main if the mapping fails.
+		void mapTape(Function* mainFunction) {
+			auto* Tint64 = builder.getInt64Ty();
+			auto* Tptr = PointerType::getUnqual(Tint8);
+
+			auto* mapping = builder.CreateCall(
+				module->getOrInsertFunction(
+					"mmap", Tptr, Tptr, Tint64, Tint32, Tint32, Tint32, Tint64),
+				{ConstantPointerNull::get(Tptr),
+				 builder.getInt64(TAPE_MAPPING<Cell>),
+				 constant(PROT_READ | PROT_WRITE, Tint32),
+				 constant(MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, Tint32),
+				 constant(-1, Tint32), builder.getInt64(0)});
+
+			auto* failBlock = BasicBlock::Create(ctx, "", mainFunction);
+			auto* mappedBlock = BasicBlock::Create(ctx, "", mainFunction);
+			builder.CreateCondBr(
+				builder.CreateICmpEQ(
+					builder.CreatePtrToInt(mapping, Tint64),
+					builder.getInt64(-1)),
+				failBlock, mappedBlock);
+
+			builder.SetInsertPoint(failBlock);
+			builder.CreateCall(
+				module->getOrInsertFunction(
+					"perror", builder.getVoidTy(), Tptr),
+				{builder.CreateGlobalStringPtr("mmap")});
+			builder.CreateRet(constant(1, Tint32));
+
+			builder.SetInsertPoint(mappedBlock);
+			auto mprotect = module->getOrInsertFunction(
+				"mprotect", Tint32, Tptr, Tint64, Tint32);
+			builder.CreateCall(
+				mprotect, {mapping, builder.getInt64(GUARD_LENGTH),
+						   constant(PROT_NONE, Tint32)});
+			builder.CreateCall(
+				mprotect,
+				{builder.CreateGEP(
+					 Tint8, mapping,
+					 {builder.getInt64(TAPE_MAPPING<Cell> - GUARD_LENGTH)}),
+				 builder.getInt64(GUARD_LENGTH), constant(PROT_NONE, Tint32)});
+			auto* handler = createSegvHandler();
+			builder.CreateCall(
+				module->getOrInsertFunction(
+					"signal", Tptr, Tint32, handler->getType()),
+				{constant(SIGSEGV, Tint32), handler});
+
+			tape = builder.CreateGEP(
+				Tint8, mapping, {builder.getInt64(GUARD_LENGTH)});
+		}
+
+		// READ's buffer and bf_read, which returns the next input byte or -1
+		// at end of input. The buffer is refilled with read(2), flushing
+		// pending output first.
+		void createInputBuffer() {
+			auto* Tint64 = builder.getInt64Ty();
+			auto* Tbuf = ArrayType::get(Tint8, IO_BUFFER_SIZE);
+			auto* inBuf = new GlobalVariable(
+				*module, Tbuf, false, GlobalValue::InternalLinkage,
+				ConstantAggregateZero::get(Tbuf), "inbuf");
+			auto* inPos = new GlobalVariable(
+				*module, Tint32, false, GlobalValue::InternalLinkage,
+				constant(0, Tint32), "inpos");
+			auto* inLen = new GlobalVariable(
+				*module, Tint32, false, GlobalValue::InternalLinkage,
+				constant(0, Tint32), "inlen");
+
+			auto* read = Function::Create(
+				FunctionType::get(
+					Tint64, {Tint32, PointerType::getUnqual(Tint8), Tint64},
+					false),
+				Function::ExternalLinkage, "read", module.get());
+			readByte = Function::Create(
+				FunctionType::get(Tint32, false), Function::InternalLinkage,
+				"bf_read", module.get());
+
+			auto* entry = BasicBlock::Create(ctx, "", readByte);
+			auto* refillBlock = BasicBlock::Create(ctx, "", readByte);
+			auto* eofBlock = BasicBlock::Create(ctx, "", readByte);
+			auto* filledBlock = BasicBlock::Create(ctx, "", readByte);
+			auto* byteBlock = BasicBlock::Create(ctx, "", readByte);
+
+			IRBuilder<> b(entry);
+			b.CreateCondBr(
+				b.CreateICmpEQ(
+					b.CreateLoad(Tint32, inPos), b.CreateLoad(Tint32, inLen)),
+				refillBlock, byteBlock);
+
+			b.SetInsertPoint(refillBlock);
+			b.CreateCall(flush);
+			auto* start = b.CreateInBoundsGEP(
+				Tbuf, inBuf, {constant(0, Tint32), constant(0, Tint32)});
+			auto* n = b.CreateCall(
+				read, {constant(0, Tint32), start,
+					   ConstantInt::get(Tint64, IO_BUFFER_SIZE)});
+			b.CreateCondBr(
+				b.CreateICmpSGT(n, ConstantInt::get(Tint64, 0)), filledBlock,
+				eofBlock);
+
+			b.SetInsertPoint(eofBlock);
+			b.CreateRet(constant(-1, Tint32));
+
+			b.SetInsertPoint(filledBlock);
+			b.CreateStore(b.CreateTrunc(n, Tint32), inLen);
+			b.CreateStore(constant(0, Tint32), inPos);
+			b.CreateBr(byteBlock);
+
+			b.SetInsertPoint(byteBlock);
+			auto* pos = b.CreateLoad(Tint32, inPos);
+			auto* byte = b.CreateLoad(
+				Tint8,
+				b.CreateInBoundsGEP(Tbuf, inBuf, {constant(0, Tint32), pos}));
+			b.CreateStore(b.CreateAdd(pos, constant(1, Tint32)), inPos);
+			b.CreateRet(b.CreateZExt(byte, Tint32));
+		}
+
+		void compileRead(int offset) {
+			auto* c = builder.CreateCall(readByte);
+			Value* value = builder.CreateTrunc(c, Tcell);
+			auto* isEOF = builder.CreateICmpSLT(c, constant(0, Tint32));
+			auto* addr = cellAddr(offset);
+			switch (args.eof) {
+				case EOFPolicy::UNCHANGED:
+					value = builder.CreateSelect(isEOF, loadCell(addr), value);
+					break;
+				case EOFPolicy::ZERO:
+					value =
+						builder.CreateSelect(isEOF, constant(0, Tcell), value);
+					break;
+				case EOFPolicy::MINUS_ONE:
+					break;
+			}
+			storeCell(addr, value);
+		}
+
+		void compileWrite(int offset) {
+			auto* addr = cellAddr(offset);
+			Value* len = builder.CreateLoad(Tint32, outLen);
+			builder.CreateStore(
+				builder.CreateTrunc(loadCell(addr), Tint8),
+				builder.CreateInBoundsGEP(
+					outBuf->getValueType(), outBuf,
+					{constant(0, Tint32), len}));
+			len = builder.CreateAdd(len, constant(1, Tint32));
+			builder.CreateStore(len, outLen);
+			// unbuffered, every byte is handed to write(2) on its own
+			if (!args.bufferedOutput) {
+				builder.CreateCall(flush);
+				return;
+			}
+
+			auto* flushBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			auto* nextBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			builder.CreateCondBr(
+				builder.CreateICmpEQ(len, constant(IO_BUFFER_SIZE, Tint32)),
+				flushBlock, nextBlock);
+			builder.SetInsertPoint(flushBlock);
+			builder.CreateCall(flush);
+			builder.CreateBr(nextBlock);
+			builder.SetInsertPoint(nextBlock);
+		}
+
+		// All members read the cells from before the LINEAR, so every new
+		// value is computed before the first store
+		void compileLinear(std::span<::Instruction> members) {
+			std::map<int, Value*> values;
+			for (const auto& m : members) {
+				if (m.code == SET_C) {
+					values[m.lRef] = constant(m.value, Tcell);
+					continue;
+				}
+				if (!values.contains(m.lRef)) { values[m.lRef] = cell(m.lRef); }
+				Value* t = constant(m.value, Tcell);
+				for (const auto& e : m.rRef) {
+					t = builder.CreateMul(t, cell(e));
+				}
+				values[m.lRef] = builder.CreateAdd(values[m.lRef], t);
+			}
+			for (const auto& [c, value] : values) {
+				storeCell(cellAddr(c), value);
+			}
+		}
+
+		// The window of a BLOCK is one vector of as many cells, the backend
+		// splits it into the vectors the target has
+		void compileBlock(
+			const ::Instruction& header, std::span<::Instruction> members) {
+			const auto& first = members.front();
+			const int size = members.back().lRef - header.lRef + 1;
+			auto* Tvec = VectorType::get(Tcell, ElementCount::getFixed(size));
+			std::vector<Constant*> values(size, constant(0, Tcell));
+			std::vector<Constant*> keep(size, constant(-1, Tcell));
+			for (const auto& m : members) {
+				values[m.lRef - header.lRef] = constant(m.value, Tcell);
+				keep[m.lRef - header.lRef] = constant(0, Tcell);
+			}
+
+			auto* addr = builder.CreateBitCast(
+				cellAddr(header.lRef), PointerType::getUnqual(Tvec));
+			Value* cells = builder.CreateAlignedLoad(Tvec, addr, Align(1));
+			if (first.code == SET_C) {
+				cells = builder.CreateOr(
+					builder.CreateAnd(cells, ConstantVector::get(keep)),
+					ConstantVector::get(values));
+			} else {
+				Value* delta = ConstantVector::get(values);
+				if (!first.rRef.empty()) {
+					delta = builder.CreateMul(
+						delta, builder.CreateVectorSplat(
+								   size, cell(first.rRef.front())));
+				}
+				cells = builder.CreateAdd(cells, delta);
+			}
+			builder.CreateAlignedStore(cells, addr, Align(1));
+		}
+
+		// A SWEEP scans for where it stops first, then runs the members for
+		// a known number of iterations, which the loop vectorizer can turn
+		// into interleaved vector accesses
+		void compileSweep(
+			const ::Instruction& header, std::span<::Instruction> members) {
+			const auto stride = header.lRef;
+			auto* function = blocks.back()->getParent();
+			auto* start = ptrValue();
+			scan({SCAN, 0, stride, {}});
+			auto* count = builder.CreateExactSDiv(
+				builder.CreateSub(ptrValue(), start), constant(stride, Tint32));
+
+			auto* entryBlock = builder.GetInsertBlock();
+			auto* condBlock = BasicBlock::Create(ctx, "", function);
+			auto* loopBlock = BasicBlock::Create(ctx, "", function);
+			auto* endBlock = BasicBlock::Create(ctx, "", function);
+
+			builder.CreateBr(condBlock);
+			builder.SetInsertPoint(condBlock);
+			auto* j = builder.CreatePHI(Tint32, 2);
+			j->addIncoming(constant(0, Tint32), entryBlock);
+			builder.CreateCondBr(
+				builder.CreateICmpSLT(j, count), loopBlock, endBlock);
+
+			builder.SetInsertPoint(loopBlock);
+			auto* base = builder.CreateAdd(
+				start, builder.CreateMul(j, constant(stride, Tint32)));
+			for (const auto& m : members) {
+				auto* addr = builder.CreateGEP(
+					Tcell, tape,
+					{builder.CreateAdd(base, constant(m.lRef, Tint32))});
+				Value* value = constant(m.value, Tcell);
+				if (m.code == INCR) {
+					value = builder.CreateAdd(loadCell(addr), value);
+				}
+				storeCell(addr, value);
+			}
+			j->addIncoming(
+				builder.CreateAdd(j, constant(1, Tint32)),
+				builder.GetInsertBlock());
+			builder.CreateBr(condBlock);
+
+			builder.SetInsertPoint(endBlock);
+		}
+
 		void slowScan(int jump) {
 			auto* condBlock =
 				BasicBlock::Create(ctx, "", blocks.back()->getParent());
@@ -316,7 +1118,7 @@ namespace llvm {
 
 			builder.CreateBr(condBlock);
 			builder.SetInsertPoint(condBlock);
-			auto* cond = builder.CreateICmpNE(cell(0), constant(0, Tint8));
+			auto* cond = builder.CreateICmpNE(cell(0), constant(0, Tcell));
 			builder.CreateCondBr(cond, loopBlock, endBlock);
 
 			builder.SetInsertPoint(loopBlock);
@@ -329,23 +1131,24 @@ namespace llvm {
 		}
 
 		void fastScan(bool isPowerOf2, bool isNeg, int jump) {
-			const int VEC_SZ = 64;
+			// cells in a vector, one mask bit per cell
+			const int VEC_SZ = vectorBytes(args.isa) / sizeof(Cell);
 			const int shift = jump - (VEC_SZ % jump);
 			const int sign = isNeg ? -1 : 1;
 
 			auto* Tint1 = builder.getInt1Ty();
-			auto* Tvec = VectorType::get(Tint8, ElementCount::getFixed(VEC_SZ));
+			auto* Tvec = VectorType::get(Tcell, ElementCount::getFixed(VEC_SZ));
 
-			auto* Tmask = builder.getInt64Ty();
+			auto* Tmask = builder.getIntNTy(VEC_SZ);
 			auto* TmaskV =
 				VectorType::get(Tint1, ElementCount::getFixed(VEC_SZ));
 
-			__mmask64 mask = 0;
+			std::uint64_t mask = 0;
 			{
-				for (auto i = 0u; i < VEC_SZ; i += jump) {
+				for (auto i = 0; i < VEC_SZ; i += jump) {
 					mask = mask | 1ULL << i;
 				}
-				if (isNeg) { mask = revBits(mask); }
+				if (isNeg) { mask = revBits(mask) >> (64 - VEC_SZ); }
 			}
 
 			auto* maskAddr =
@@ -354,6 +1157,9 @@ namespace llvm {
 				builder.CreateBitCast(ConstantInt::get(Tmask, mask), Tmask),
 				maskAddr);
 
+			// a vector that would reach past the tape sends the scan back
+			// here and slowScan finishes it
+			auto* start = ptrValue();
 			if (isNeg) { incrPtr(-VEC_SZ + 1); }
 
 			auto* rhs = ConstantAggregateZero::get(Tvec);
@@ -364,13 +1170,25 @@ namespace llvm {
 
 			auto* scanBlock =
 				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			auto* loadBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			auto* tailBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			auto* doneBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
 
 			builder.CreateBr(scanBlock);
 			builder.SetInsertPoint(scanBlock);
 
 			incrPtr(sign * VEC_SZ);
+			builder.CreateCondBr(
+				builder.CreateICmpULE(
+					ptrValue(), constant(TAPE_LENGTH - VEC_SZ, Tint32)),
+				loadBlock, tailBlock);
+
+			builder.SetInsertPoint(loadBlock);
 			builder.CreateStore(
-				builder.CreateAlignedLoad(Tvec, cellAddr(0), tape->getAlign()),
+				builder.CreateAlignedLoad(Tvec, cellAddr(0), Align(1)),
 				lhs);
 
 			// Compare vector with zero vector
@@ -420,7 +1238,7 @@ namespace llvm {
 				{Tmask});
 			Value* res =
 				builder.CreateCall(func, {cmp, builder.getInt1(false)});
-			res = builder.CreateTrunc(res, Tint32);
+			res = builder.CreateZExtOrTrunc(res, Tint32);
 
 			Value* ptrVal = builder.CreateLoad(Tint32, ptr);
 
@@ -432,14 +1250,113 @@ namespace llvm {
 				ptrVal = builder.CreateAdd(ptrVal, res);
 			}
 			builder.CreateStore(ptrVal, ptr);
+			builder.CreateBr(doneBlock);
+
+			builder.SetInsertPoint(tailBlock);
+			builder.CreateStore(start, ptr);
+			slowScan(sign * jump);
+			builder.CreateBr(doneBlock);
+
+			builder.SetInsertPoint(doneBlock);
+		}
+
+		// Scan for jumps too large for a vector to hold a full period. Lane
+		// k of a gather loads 32 bits at the kth cell visited, narrower cells
+		// drop the bits of their neighbours before the compare. Gathers that
+		// would reach past the tape are left to slowScan.
+		void stridedScan(int jump) {
+			const int N = vectorBytes(args.isa) / 4;
+			// cells covered by the 32 bit load of a lane
+			const int width = 4 / sizeof(Cell);
+			const auto reach = (N - 1) * jump;
+			const auto low = std::min(0, reach);
+			const auto high = std::max(0, reach) + width;
+
+			auto* Tint1 = builder.getInt1Ty();
+			auto* Tvec = VectorType::get(Tint32, ElementCount::getFixed(N));
+			auto* Tmask = builder.getIntNTy(N);
+			auto* Tptrs = VectorType::get(
+				PointerType::getUnqual(Tint32), ElementCount::getFixed(N));
+
+			std::vector<Constant*> steps;
+			for (auto k = 0; k < N; ++k) {
+				steps.push_back(constant(k * jump, Tint32));
+			}
+			auto* offsets = ConstantVector::get(steps);
+			auto* cellMask =
+				ConstantInt::get(Tvec, std::numeric_limits<Cell>::max());
+			auto* allLanes = ConstantInt::getTrue(
+				VectorType::get(Tint1, ElementCount::getFixed(N)));
+
+			incrPtr(-N * jump);
+
+			auto* scanBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			auto* gatherBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			auto* foundBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			auto* tailBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+			auto* endBlock =
+				BasicBlock::Create(ctx, "", blocks.back()->getParent());
+
+			builder.CreateBr(scanBlock);
+			builder.SetInsertPoint(scanBlock);
+
+			incrPtr(N * jump);
+			// one unsigned compare tests both ends of the tape
+			auto* onTape = builder.CreateICmpULE(
+				builder.CreateAdd(ptrValue(), constant(low, Tint32)),
+				constant(TAPE_LENGTH - (high - low), Tint32));
+			builder.CreateCondBr(onTape, gatherBlock, tailBlock);
+
+			builder.SetInsertPoint(gatherBlock);
+			auto* idx =
+				builder.CreateAdd(builder.CreateVectorSplat(N, ptrValue()), offsets);
+			auto* ptrs = builder.CreateBitCast(
+				builder.CreateGEP(Tcell, tape, {idx}), Tptrs);
+			Value* cells =
+				builder.CreateMaskedGather(Tvec, ptrs, Align(1), allLanes);
+			cells = builder.CreateAnd(cells, cellMask);
+			auto* cmp = builder.CreateBitCast(
+				builder.CreateICmpEQ(cells, ConstantAggregateZero::get(Tvec)),
+				Tmask);
+
+			auto* cond = builder.CreateICmpEQ(cmp, constant(0, Tmask));
+			builder.CreateCondBr(cond, scanBlock, foundBlock);
+
+			builder.SetInsertPoint(foundBlock);
+
+			auto* func = Intrinsic::getDeclaration(
+				module.get(), Intrinsic::cttz, {Tmask});
+			Value* res =
+				builder.CreateCall(func, {cmp, builder.getInt1(false)});
+			res = builder.CreateZExtOrTrunc(res, Tint32);
+			res = builder.CreateMul(res, constant(jump, Tint32));
+			builder.CreateStore(builder.CreateAdd(ptrValue(), res), ptr);
+			builder.CreateBr(endBlock);
+
+			builder.SetInsertPoint(tailBlock);
+			slowScan(jump);
+			builder.CreateBr(endBlock);
+
+			builder.SetInsertPoint(endBlock);
 		}
 
 		void scan(const ::Instruction& i) {
 			constexpr auto LARGE_JUMP = 16;
+			const int lanes = vectorBytes(args.isa) / sizeof(Cell);
 			auto jump = i.value;
 
-			if (std::abs(jump) >= LARGE_JUMP) {
-				slowScan(jump);
+			// the mask rotation needs every vector to hold a full period,
+			// larger jumps gather when there is a gather instruction
+			if (std::abs(jump) >= LARGE_JUMP || std::abs(jump) > lanes) {
+				if (args.isa == ISA::AVX512BW || args.isa == ISA::AVX2) {
+					stridedScan(jump);
+				} else {
+					slowScan(jump);
+				}
 				return;
 			}
 			auto isNeg = jump < 0;
@@ -450,7 +1367,8 @@ namespace llvm {
 		}
 
 		bool compile(std::span<::Instruction> code) {
-			for (const auto& i : code) {
+			for (auto k = 0u; k < code.size(); ++k) {
+				const auto& i = code[k];
 				switch (i.code) {
 					case NO_OP:
 						break;
@@ -459,45 +1377,29 @@ namespace llvm {
 						break;
 
 					case SET_C:
-						storeCell(cellAddr(i.lRef), constant(i.value, Tint8));
+						storeCell(cellAddr(i.lRef), constant(i.value, Tcell));
 						break;
 					case INCR: {
 						compileIncr(i);
 						break;
 					}
 					case WRITE:
-						builder.CreateCall(
-							module->getFunction("putchar"),
-							{builder.CreateZExt(
-								loadCell(cellAddr(0)), Tint32)});
+						compileWrite(i.lRef);
 						break;
 					case READ:
-						storeCell(
-							cellAddr(0),
-							builder.CreateTrunc(
-								builder.CreateCall(
-									module->getFunction("getchar"), {}),
-								Tint8)
-
-						);
+						compileRead(i.lRef);
+						break;
+					case LINEAR:
+						compileLinear(code.subspan(k + 1, i.value));
+						k += i.value;
 						break;
-					case WRITE_LOCK:
-						if (locks.contains(i.lRef)) {
-							::print(
-								std::cerr, "Inst: cell % is already locked",
-								i.lRef);
-							return false;
-						}
-						locks[i.lRef] = cell(i.lRef);
+					case BLOCK:
+						compileBlock(i, code.subspan(k + 1, i.value));
+						k += i.value;
 						break;
-					case WRITE_UNLOCK:
-						if (!locks.contains(i.lRef)) {
-							::print(
-								std::cerr, "Inst: %: cell % is not locked",
-								i.lRef);
-							return false;
-						}
-						locks.erase(i.lRef);
+					case SWEEP:
+						compileSweep(i, code.subspan(k + 1, i.value));
+						k += i.value;
 						break;
 					case JUMP_C: {
 						auto* condBlock = BasicBlock::Create(
@@ -510,7 +1412,7 @@ namespace llvm {
 						builder.CreateBr(condBlock);
 						builder.SetInsertPoint(condBlock);
 						auto* cond =
-							builder.CreateICmpNE(cell(0), constant(0, Tint8));
+							builder.CreateICmpNE(cell(0), constant(0, Tcell));
 						builder.CreateCondBr(cond, loopBlock, endBlock);
 
 						// Set loopBlockPush as current so all subsequent
@@ -600,7 +1502,9 @@ namespace llvm {
 			}
 
 			const auto* CPU = "generic";
-			const auto* Features = "+avx512bw";
+			const auto* Features = args.isa == ISA::AVX512BW ? "+avx512bw"
+								   : args.isa == ISA::AVX2	 ? "+avx2,+fast-gather"
+															 : "";
 
 			TargetOptions opt;
 			auto targetMachine =
@@ -633,26 +1537,18 @@ namespace llvm {
 		}
 
 	   public:
-		Compiler()
-			: module(std::make_unique<Module>("BF Module", ctx)),
+		explicit Compiler(const Args& args)
+			: args(args),
+			  module(std::make_unique<Module>("BF Module", ctx)),
 			  builder(ctx),
 			  Tint8(builder.getInt8Ty()),
-			  Tint32(builder.getInt32Ty()) {}
+			  Tint32(builder.getInt32Ty()),
+			  Tcell(builder.getIntNTy(8 * sizeof(Cell))) {}
 
 		bool compile(
 			std::span<::Instruction> code, const std::filesystem::path& path) {
-			{
-				// Create declaration for putchar and getchar
-				auto* functionType = FunctionType::get(Tint32, {Tint32}, false);
-				Function::Create(
-					functionType, Function::ExternalLinkage, "putchar",
-					module.get());
-
-				functionType = FunctionType::get(Tint32, false);
-				Function::Create(
-					functionType, Function::ExternalLinkage, "getchar",
-					module.get());
-			}
+			createOutputBuffer();
+			createInputBuffer();
 
 			auto* functionReturnType = FunctionType::get(Tint32, false);
 			auto* mainFunction = Function::Create(
@@ -664,20 +1560,16 @@ namespace llvm {
 
 			blocks.push_back(body);
 
-			tape = builder.CreateAlloca(
-				Tint8, constant(TAPE_LENGTH, Tint32), "tape");
-			builder.CreateMemSet(
-				builder.CreateGEP(Tint8, tape, {constant(0, Tint32)}),
-				constant(0, Tint8), constant(TAPE_LENGTH, Tint32),
-				tape->getAlign());
-
 			{
 				ptr = builder.CreateAlloca(Tint32, constant(1, Tint32), "ptr");
 				builder.CreateStore(constant(TAPE_LENGTH / 2, Tint32), ptr);
 			}
 
+			mapTape(mainFunction);
+
 			auto result = compile(code);
 			// auto result = true;
+			builder.CreateCall(flush);
 			builder.CreateRet(constant(0, Tint32));
 
 #ifdef LOG_INST
@@ -695,17 +1587,17 @@ namespace llvm {
 		void print() { module->print(llvm::errs(), nullptr); }
 	};
 
+	template <CellType Cell>
 	bool compile(
-		std::span<::Instruction> code, const std::filesystem::path& path) {
-		Compiler compiler;
+		std::span<::Instruction> code, const std::filesystem::path& path,
+		const Args& args) {
+		Compiler<Cell> compiler(args);
 		return compiler.compile(code, path);
 	}
 }  // namespace llvm
 
-int main(int argc, char* argv[]) {
-	llvm::InitLLVM(argc, argv);
-	auto args = argparse(argc, argv);
-	Program p(args);
+template <CellType Cell> int compile(const Args& args) {
+	Program<Cell> p(args);
 
 	if (!p.isOK()) {
 		std::cerr << p.error() << "\n";
@@ -717,10 +1609,10 @@ int main(int argc, char* argv[]) {
 
 	auto compiled = false;
 	if (args.useLLVM) {
-		compiled = llvm::compile(p.instructions(), outputPath);
+		compiled = llvm::compile<Cell>(p.instructions(), outputPath, args);
 	} else {
 		outputPath.replace_extension(".s");
-		compiled = manual::compile(p.instructions(), outputPath);
+		compiled = manual::compile<Cell>(p.instructions(), outputPath, args);
 	}
 	if (!compiled) {
 		print(
@@ -742,3 +1634,19 @@ int main(int argc, char* argv[]) {
 	std::cerr << "Bug in compiler\n";
 	return 1;
 }
+
+int main(int argc, char* argv[]) {
+	llvm::InitLLVM(argc, argv);
+	auto args = argparse(argc, argv);
+	// generated code targets this machine unless told otherwise
+	if (args.isa == ISA::NATIVE) { args.isa = hostISA(); }
+
+	switch (args.cellWidth) {
+		case 16:
+			return compile<std::uint16_t>(args);
+		case 32:
+			return compile<std::uint32_t>(args);
+		default:
+			return compile<std::uint8_t>(args);
+	}
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Vector keeping up to N elements inline, only longer ones get a heap
+// buffer. Elements are trivially copyable, so they move around as bytes.
+template <typename T, std::size_t N> class SmallVector {
+	static_assert(std::is_trivially_copyable_v<T>);
+	static_assert(N > 0);
+
+	union {
+		T local[N];
+		T* heap;
+	};
+	// a heap buffer is always larger than N
+	std::uint32_t count = 0, capacity = N;
+
+	bool isLocal() const { return capacity == N; }
+
+	void release() {
+		if (!isLocal()) { std::allocator<T>().deallocate(heap, capacity); }
+		count = 0;
+		capacity = N;
+	}
+
+	void steal(SmallVector& other) {
+		if (other.isLocal()) {
+			std::copy(other.local, other.local + other.count, local);
+		} else {
+			heap = other.heap;
+		}
+		count = other.count;
+		capacity = other.capacity;
+		other.count = 0;
+		other.capacity = N;
+	}
+
+	void grow(std::size_t n) {
+		if (n > capacity) { reserve(std::max<std::size_t>(n, 2 * capacity)); }
+	}
+
+   public:
+	using value_type = T;
+	using iterator = T*;
+	using const_iterator = const T*;
+
+	SmallVector() {}
+	SmallVector(std::initializer_list<T> init) {
+		insert(end(), init.begin(), init.end());
+	}
+	template <std::forward_iterator It> SmallVector(It first, It last) {
+		insert(end(), first, last);
+	}
+	SmallVector(const SmallVector& other) {
+		insert(end(), other.begin(), other.end());
+	}
+	SmallVector(SmallVector&& other) noexcept { steal(other); }
+	~SmallVector() { release(); }
+
+	SmallVector& operator=(const SmallVector& other) {
+		if (this != &other) {
+			clear();
+			insert(end(), other.begin(), other.end());
+		}
+		return *this;
+	}
+	SmallVector& operator=(SmallVector&& other) noexcept {
+		if (this != &other) {
+			release();
+			steal(other);
+		}
+		return *this;
+	}
+
+	T* data() { return isLocal() ? local : heap; }
+	const T* data() const { return isLocal() ? local : heap; }
+	iterator begin() { return data(); }
+	iterator end() { return data() + count; }
+	const_iterator begin() const { return data(); }
+	const_iterator end() const { return data() + count; }
+
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T& operator[](std::size_t i) { return data()[i]; }
+	const T& operator[](std::size_t i) const { return data()[i]; }
+	T& front() { return data()[0]; }
+	const T& front() const { return data()[0]; }
+	T& back() { return data()[count - 1]; }
+	const T& back() const { return data()[count - 1]; }
+
+	void clear() { count = 0; }
+
+	void reserve(std::size_t n) {
+		if (n <= capacity) { return; }
+		auto* buffer = std::allocator<T>().allocate(n);
+		std::copy(begin(), end(), buffer);
+		const auto size = count;
+		release();
+		heap = buffer;
+		count = size;
+		capacity = static_cast<std::uint32_t>(n);
+	}
+
+	void push_back(const T& value) {
+		const auto copy = value;
+		grow(count + 1);
+		data()[count++] = copy;
+	}
+
+	iterator insert(const_iterator pos, const T& value) {
+		return insert(pos, &value, &value + 1);
+	}
+
+	template <std::forward_iterator It>
+	iterator insert(const_iterator pos, It first, It last) {
+		const auto offset = pos - begin();
+		const auto n = static_cast<std::size_t>(std::distance(first, last));
+		if (n == 0) { return begin() + offset; }
+		// the range may live in this vector, copy it out before growing
+		SmallVector copy;
+		if (n > N) { copy.reserve(n); }
+		std::copy(first, last, copy.data());
+		grow(count + n);
+		std::copy_backward(begin() + offset, end(), end() + n);
+		std::copy(copy.data(), copy.data() + n, begin() + offset);
+		count += static_cast<std::uint32_t>(n);
+		return begin() + offset;
+	}
+
+	friend bool operator==(const SmallVector& a, const SmallVector& b) {
+		return std::equal(a.begin(), a.end(), b.begin(), b.end());
+	}
+	friend auto operator<=>(const SmallVector& a, const SmallVector& b) {
+		return std::lexicographical_compare_three_way(
+			a.begin(), a.end(), b.begin(), b.end());
+	}
+};
+
+// Set kept as a sorted vector, for the handful of keys the analyses of a
+// loop collect
+template <typename K> class FlatSet {
+	std::vector<K> keys;
+
+   public:
+	using value_type = K;
+	using const_iterator = typename std::vector<K>::const_iterator;
+	using const_reverse_iterator =
+		typename std::vector<K>::const_reverse_iterator;
+
+	std::pair<const_iterator, bool> insert(const K& key) {
+		auto itr = std::lower_bound(keys.begin(), keys.end(), key);
+		if (itr != keys.end() && *itr == key) { return {itr, false}; }
+		return {keys.insert(itr, key), true};
+	}
+	bool contains(const K& key) const {
+		return std::binary_search(keys.begin(), keys.end(), key);
+	}
+
+	const_iterator begin() const { return keys.begin(); }
+	const_iterator end() const { return keys.end(); }
+	const_reverse_iterator rbegin() const { return keys.rbegin(); }
+	const_reverse_iterator rend() const { return keys.rend(); }
+	std::size_t size() const { return keys.size(); }
+	bool empty() const { return keys.empty(); }
+	void clear() { keys.clear(); }
+
+	friend bool operator==(const FlatSet&, const FlatSet&) = default;
+};
+
+// Map kept as a vector of pairs sorted by key. Lookups are binary searches
+// and an insert shifts the entries after it, which for the few keys of a
+// loop or a polynomial beats a heap node per entry. Keys inserted in order
+// are appended.
+template <typename K, typename V> class FlatMap {
+	using Entry = std::pair<K, V>;
+	std::vector<Entry> entries;
+
+	static bool before(const Entry& e, const K& key) { return e.first < key; }
+
+   public:
+	using value_type = Entry;
+	using iterator = typename std::vector<Entry>::iterator;
+	using const_iterator = typename std::vector<Entry>::const_iterator;
+
+	FlatMap() = default;
+	FlatMap(std::initializer_list<Entry> init) {
+		for (const auto& [key, value] : init) { try_emplace(key, value); }
+	}
+
+	iterator lower_bound(const K& key) {
+		return std::lower_bound(entries.begin(), entries.end(), key, before);
+	}
+	const_iterator lower_bound(const K& key) const {
+		return std::lower_bound(entries.begin(), entries.end(), key, before);
+	}
+	iterator find(const K& key) {
+		auto itr = lower_bound(key);
+		return itr != end() && itr->first == key ? itr : end();
+	}
+	const_iterator find(const K& key) const {
+		auto itr = lower_bound(key);
+		return itr != end() && itr->first == key ? itr : end();
+	}
+	bool contains(const K& key) const { return find(key) != end(); }
+
+	template <typename... Args>
+	std::pair<iterator, bool> try_emplace(const K& key, Args&&... args) {
+		auto itr = entries.empty() || before(entries.back(), key)
+					   ? entries.end()
+					   : lower_bound(key);
+		if (itr != end() && itr->first == key) { return {itr, false}; }
+		itr = entries.emplace(
+			itr, std::piecewise_construct, std::forward_as_tuple(key),
+			std::forward_as_tuple(std::forward<Args>(args)...));
+		return {itr, true};
+	}
+	V& operator[](const K& key) { return try_emplace(key).first->second; }
+	V& at(const K& key) {
+		auto itr = find(key);
+		if (itr == end()) { throw std::out_of_range("FlatMap::at"); }
+		return itr->second;
+	}
+	const V& at(const K& key) const {
+		auto itr = find(key);
+		if (itr == end()) { throw std::out_of_range("FlatMap::at"); }
+		return itr->second;
+	}
+
+	std::size_t erase(const K& key) {
+		auto itr = find(key);
+		if (itr == end()) { return 0; }
+		entries.erase(itr);
+		return 1;
+	}
+
+	iterator begin() { return entries.begin(); }
+	iterator end() { return entries.end(); }
+	const_iterator begin() const { return entries.begin(); }
+	const_iterator end() const { return entries.end(); }
+	std::size_t size() const { return entries.size(); }
+	bool empty() const { return entries.empty(); }
+	void clear() { entries.clear(); }
+	void reserve(std::size_t n) { entries.reserve(n); }
+
+	friend bool operator==(const FlatMap&, const FlatMap&) = default;
+};
@@ -1,110 +1,143 @@
-#include <immintrin.h>
-
+#include <cstring>
 #include <iostream>
 #include <span>
 #include <vector>
 
+#include "bytecode.hpp"
+#include "io.hpp"
 #include "parser.hpp"
+#include "scan.hpp"
+#include "tape.hpp"
 #include "util.hpp"
 
-int slowScan(const std::vector<DATA_TYPE>& tape, int BASE, int jump) {
-	for (auto i = 0;; i += jump) {
-		if (tape[i + BASE] == 0) { return i; }
-	}
-	return -1;
-}
-
-using VEC = __m512i;
-constexpr auto VEC_SZ = sizeof(VEC) / sizeof(DATA_TYPE);
-
-auto maskFromJump(int jump) {
-	__mmask64 m = 0;
-	for (auto i = 0u; i < VEC_SZ; i += jump) { m = m | 1ULL << i; }
-	return m;
+// Multiplier of an INCR, i.e. its value times all referenced cells
+template <CellType Cell>
+Cell product(
+	const ByteCode& bc, const Op& op, std::span<const Cell> tape, int ptr) {
+	Cell t = op.value;
+	if (op.nRefs == 1) { return t * tape[ptr + op.ref]; }
+	for (const auto& r : bc.refs(op)) { t *= tape[ptr + r]; }
+	return t;
 }
 
-template <bool isPowerOf2, bool isJumpNegative>
-int fastScan(const std::vector<DATA_TYPE>& tape, int BASE, int jump) {
-	auto i = 0;
-	const auto* ptr = reinterpret_cast<const VEC*>(&tape[BASE]);
-
-	if constexpr (isJumpNegative) {
-		ptr = reinterpret_cast<const VEC*>(&tape[BASE - VEC_SZ + 1]);
+// Parallel assignment: every member reads the tape as it was before the
+// LINEAR, so all right hand sides go to scratch before anything is stored.
+template <CellType Cell>
+void linear(
+	const ByteCode& bc, const Op* inst, std::span<Cell> tape, int ptr,
+	std::vector<Cell>& scratch) {
+	const auto members = std::span(inst + 1, inst->value);
+	for (auto k = 0u; k < members.size(); ++k) {
+		scratch[k] = members[k].code == SET_C
+						 ? members[k].value
+						 : product<Cell>(bc, members[k], tape, ptr);
 	}
-
-	// generate a mask marking elements visited by jump
-	auto mask = maskFromJump(jump);
-	int shift = 0;
-
-	if constexpr (!isPowerOf2) {
-		// only used when powerOf2 is false;
-		// how much the mask shifts
-		shift = jump - static_cast<int>(VEC_SZ) % jump;
-		// std::cout << "shift = " << shift << "\n";
-	}
-	if (isJumpNegative) { mask = revBits(mask); }
-
-	// value to test for
-	const VEC v_rhs = _mm512_setzero_si512();
-
-	for (;; i += VEC_SZ) {
-		// load VEC_SZ elements into a variable
-		auto v_lhs = _mm512_loadu_si512(ptr);
-		// result has its ith bit set if ith element == 0
-		auto v_eq = _mm512_mask_cmpeq_epi8_mask(mask, v_lhs, v_rhs);
-
-		if (v_eq != 0) {  // found something somewhere
-			// find the first/last set bit
-			if constexpr (isJumpNegative) { return std::countl_zero(v_eq) + i; }
-			return std::countr_zero(v_eq) + i;
+	for (auto k = 0u; k < members.size(); ++k) {
+		auto& cell = tape[ptr + members[k].lRef];
+		if (members[k].code == SET_C) {
+			cell = scratch[k];
+		} else {
+			cell += scratch[k];
 		}
+	}
+}
 
-		if constexpr (!isPowerOf2) {
-			if constexpr (isJumpNegative) {
-				mask = (mask >> shift) | (mask << (jump - shift));
-			} else {
-				mask = (mask << shift) | (mask >> (jump - shift));
-			}
+// Updates the window of cells a BLOCK covers 16 bytes at a time. The rows
+// of constants are padded to whole vectors, so the last vector runs past
+// the window unless that would leave the tape, then the cells are updated
+// one by one.
+template <CellType Cell>
+void block(
+	const Op* inst, std::span<Cell> tape, int ptr,
+	std::span<const Cell> constants) {
+	typedef Cell Vec __attribute__((vector_size(16)));
+	constexpr auto LANES = static_cast<int>(sizeof(Vec) / sizeof(Cell));
+
+	const auto& first = inst[1];
+	const auto start = ptr + inst->lRef;
+	const auto size = inst[inst->value].lRef - inst->lRef + 1;
+	const auto padded =
+		(size + BLOCK_PADDING - 1) / BLOCK_PADDING * BLOCK_PADDING;
+	const auto isSet = first.code == SET_C;
+	const Cell factor = first.nRefs == 0 ? 1 : tape[ptr + first.ref];
+	auto* cells = tape.data() + start;
+	const auto* values = constants.data() + inst->ref;
+	const auto* keep = values + padded;
+
+	const auto vectors = (size + LANES - 1) / LANES * LANES;
+	if (start + vectors > static_cast<int>(tape.size())) {
+		for (auto k = 0; k < size; ++k) {
+			cells[k] = isSet ? (cells[k] & keep[k]) | values[k]
+							 : cells[k] + factor * values[k];
 		}
-		if constexpr (isJumpNegative) {
-			ptr--;
+		return;
+	}
+	for (auto k = 0; k < vectors; k += LANES) {
+		Vec c, v;
+		std::memcpy(&c, cells + k, sizeof(Vec));
+		std::memcpy(&v, values + k, sizeof(Vec));
+		if (isSet) {
+			Vec m;
+			std::memcpy(&m, keep + k, sizeof(Vec));
+			c = (c & m) | v;
 		} else {
-			ptr++;
+			c += factor * v;
 		}
+		std::memcpy(cells + k, &c, sizeof(Vec));
 	}
-	return -1;
 }
 
-int scan(const std::vector<DATA_TYPE>& tape, int BASE, int jump) {
-	if (jump == 0) {
-		if (tape[BASE] == 0) { return 0; }
+// Finds where a SWEEP stops with the SCAN kernel, then updates the window
+// of cells the iterations up to there change, 16 bytes at a time. Cell k of
+// the window takes the constants at k modulo the period, which the rows of
+// constants repeat past their end so vectors can start anywhere in them.
+// Returns the distance the pointer moves.
+template <CellType Cell>
+int sweep(
+	const Op* inst, std::span<Cell> tape, int ptr,
+	std::span<const Cell> constants, ScanKernel<Cell> scan) {
+	typedef Cell Vec __attribute__((vector_size(16)));
+	constexpr auto LANES = static_cast<int>(sizeof(Vec) / sizeof(Cell));
+
+	const auto stride = inst->lRef;
+	const auto distance = scan(tape, ptr, stride);
+	const auto period = std::abs(stride);
+	const auto size = distance / stride * period;
+	auto* cells = tape.data() + (stride > 0 ? ptr : ptr + distance + 1);
+	const auto* keep = constants.data() + inst->ref;
+	const auto* add = keep + period + BLOCK_PADDING;
+
+	auto k = 0, phase = 0;
+	for (; k + LANES <= size; k += LANES) {
+		Vec c, m, v;
+		std::memcpy(&c, cells + k, sizeof(Vec));
+		std::memcpy(&m, keep + phase, sizeof(Vec));
+		std::memcpy(&v, add + phase, sizeof(Vec));
+		c = (c & m) + v;
+		std::memcpy(cells + k, &c, sizeof(Vec));
+		phase = (phase + LANES) % period;
 	}
-	constexpr auto LARGE_JUMP = 16;
-	if (std::abs(jump) >= LARGE_JUMP) { return slowScan(tape, BASE, jump); }
-	auto isNeg = jump < 0;
-	if (isNeg) { jump = -jump; }
-	auto isPowerOf2 = (jump & (jump - 1)) == 0;
-
-	if (isPowerOf2) {
-		if (isNeg) { return -fastScan<true, true>(tape, BASE, jump); }
-		return fastScan<true, false>(tape, BASE, jump);
+	for (; k < size; ++k) {
+		cells[k] = (cells[k] & keep[phase]) + add[phase];
+		phase = phase + 1 == period ? 0 : phase + 1;
 	}
-	if (isNeg) { return -fastScan<false, true>(tape, BASE, jump); }
-	return fastScan<false, false>(tape, BASE, jump);
+	return distance;
 }
 
-auto run(std::span<Instruction> code) {
-	const auto TAPE_LENGTH = 1000000u;
-
-	std::vector<DATA_TYPE> tape(TAPE_LENGTH, 0);
+template <CellType Cell, typename Profiler>
+void run(
+	const ByteCode& bc, Profiler& profile, OutputBuffer& out, InputBuffer& in,
+	ScanKernel<Cell> scan) {
+	const auto& code = bc.ops;
+	Tape<Cell> memory(out);
+	const auto tape = memory.cells();
 	int ptr = TAPE_LENGTH / 2;
 
-	std::map<int, DATA_TYPE> temp;
+	std::vector<Cell> scratch(bc.scratch);
+	const std::vector<Cell> constants(bc.operands.begin(), bc.operands.end());
 
-	std::vector<int> count(code.size(), 0);
 	for (auto itr = code.begin(); itr != code.end(); itr++) {
 		const auto& inst = *itr;
-		count[itr - code.begin()]++;
 		switch (inst.code) {
 			case TAPE_M:
 				ptr += inst.value;
@@ -115,52 +148,57 @@ auto run(std::span<Instruction> code) {
 				break;
 			}
 
-			case WRITE_LOCK:
-				temp[ptr + inst.lRef] = tape[ptr + inst.lRef];
+			case LINEAR:
+				linear(bc, &inst, tape, ptr, scratch);
+				itr += inst.value;
+				break;
+
+			case BLOCK:
+				block<Cell>(&inst, tape, ptr, constants);
+				itr += inst.value;
 				break;
 
-			case WRITE_UNLOCK:
-				tape[ptr + inst.lRef] = temp[ptr + inst.lRef];
-				temp.erase(ptr + inst.lRef);
+			case SWEEP:
+				ptr += sweep<Cell>(&inst, tape, ptr, constants, scan);
+				itr += inst.value;
 				break;
 
 			case SET_C:
-				if (temp.contains(ptr + inst.lRef)) {
-					temp[ptr + inst.lRef] = inst.value;
-				} else {
-					tape[ptr + inst.lRef] = inst.value;
-				}
+				tape[ptr + inst.lRef] = inst.value;
 				break;
 
 			case WRITE:
-				std::putchar(tape[ptr]);
+				out.put(static_cast<char>(tape[ptr + inst.lRef]));
 				break;
 
 			case READ:
-				tape[ptr] = std::getchar();
+				in.read(tape[ptr + inst.lRef]);
 				break;
 
 			case JUMP_C:
-				if (tape[ptr] == 0) { itr += inst.value; }
+				if (tape[ptr] == 0) {
+					itr += inst.value;
+				} else {
+					profile.enterLoop(itr - code.begin());
+				}
 				break;
 
 			case JUMP_O:
-				if (tape[ptr] != 0) { itr += inst.value; }
+				if (tape[ptr] != 0) {
+					profile.backEdge(itr - code.begin());
+					itr += inst.value;
+				}
 				break;
 
 			case INCR: {
-				DATA_TYPE t = inst.value;
-				for (const auto& r : inst.rRef) { t *= tape[ptr + r]; }
-				if (temp.contains(ptr + inst.lRef)) {
-					temp[ptr + inst.lRef] += t;
-				} else {
-					tape[ptr + inst.lRef] += t;
-				}
+				tape[ptr + inst.lRef] += product<Cell>(bc, inst, tape, ptr);
 				break;
 			}
 
 			case DEBUG: {
-				std::cout << "tape[" << ptr << "] = " << (int)tape[ptr] << '\n';
+				out.flush();
+				std::cout << "tape[" << ptr << "] = " << (int)tape[ptr]
+						  << std::endl;
 				// 		std::cout << "index = " << index << '\n';
 				// 		while (!left.empty()) {
 				// 			const auto& e = left.back();
@@ -174,30 +212,215 @@ auto run(std::span<Instruction> code) {
 			case NO_OP:
 				break;
 			case HALT:
-				return count;
+				return;
 		}
 	}
-	return count;
 }
 
-int main(int argc, char* argv[]) {
-	auto args = argparse(argc, argv);
+// Direct-threaded engine. Every instruction is lowered to the address of its
+// handler and each handler jumps straight to the next one, so there is no
+// shared switch and no loop bookkeeping between instructions.
+template <CellType Cell, typename Profiler>
+void runThreaded(
+	const ByteCode& bc, Profiler& profile, OutputBuffer& out, InputBuffer& in,
+	ScanKernel<Cell> scan) {
+	const auto& code = bc.ops;
+	Tape<Cell> memory(out);
+	const auto tape = memory.cells();
+	int ptr = TAPE_LENGTH / 2;
+
+	std::vector<Cell> scratch(bc.scratch);
+	const std::vector<Cell> constants(bc.operands.begin(), bc.operands.end());
+
+	std::vector<const void*> handlers(code.size());
+	for (auto i = 0u; i < code.size(); ++i) {
+		switch (code[i].code) {
+			case NO_OP:
+				handlers[i] = &&DO_NO_OP;
+				break;
+			case TAPE_M:
+				handlers[i] = &&DO_TAPE_M;
+				break;
+			case INCR:
+				if (code[i].nRefs == 0) {
+					handlers[i] = &&DO_INCR;
+				} else if (code[i].nRefs == 1) {
+					handlers[i] = &&DO_INCR_MUL;
+				} else {
+					handlers[i] = &&DO_INCR_POLY;
+				}
+				break;
+			case SET_C:
+				handlers[i] = &&DO_SET_C;
+				break;
+			case WRITE:
+				handlers[i] = &&DO_WRITE;
+				break;
+			case READ:
+				handlers[i] = &&DO_READ;
+				break;
+			case JUMP_C:
+				handlers[i] = &&DO_JUMP_C;
+				break;
+			case JUMP_O:
+				handlers[i] = &&DO_JUMP_O;
+				break;
+			case SCAN:
+				handlers[i] = &&DO_SCAN;
+				break;
+			case LINEAR:
+				handlers[i] = &&DO_LINEAR;
+				break;
+			case BLOCK:
+				handlers[i] = &&DO_BLOCK;
+				break;
+			case SWEEP:
+				handlers[i] = &&DO_SWEEP;
+				break;
+			case DEBUG:
+				handlers[i] = &&DO_DEBUG;
+				break;
+			case HALT:
+				handlers[i] = &&DO_HALT;
+				break;
+		}
+	}
+	// parser always terminates the program with HALT
+	if (code.empty() || code.back().code != HALT) { return; }
+
+	const Op* inst = code.data();
+	const void* const* next = handlers.data();
+
+#define DISPATCH()     \
+	do {               \
+		inst++;        \
+		goto** ++next; \
+	} while (false)
+#define JUMP(OFFSET)                      \
+	do {                                  \
+		const auto offset = (OFFSET) + 1; \
+		inst += offset;                   \
+		next += offset;                   \
+		goto** next;                      \
+	} while (false)
+
+	goto** next;
+
+DO_NO_OP:
+	DISPATCH();
+
+DO_TAPE_M:
+	ptr += inst->value;
+	DISPATCH();
+
+DO_SCAN:
+	ptr += scan(tape, ptr, inst->value);
+	DISPATCH();
+
+DO_LINEAR:
+	linear(bc, inst, tape, ptr, scratch);
+	JUMP(inst->value);
+
+DO_BLOCK:
+	block<Cell>(inst, tape, ptr, constants);
+	JUMP(inst->value);
+
+DO_SWEEP:
+	ptr += sweep<Cell>(inst, tape, ptr, constants, scan);
+	JUMP(inst->value);
+
+DO_SET_C:
+	tape[ptr + inst->lRef] = inst->value;
+	DISPATCH();
+
+DO_WRITE:
+	out.put(static_cast<char>(tape[ptr + inst->lRef]));
+	DISPATCH();
+
+DO_READ:
+	in.read(tape[ptr + inst->lRef]);
+	DISPATCH();
+
+DO_JUMP_C:
+	if (tape[ptr] == 0) { JUMP(inst->value); }
+	profile.enterLoop(inst - code.data());
+	DISPATCH();
+
+DO_JUMP_O:
+	if (tape[ptr] != 0) {
+		profile.backEdge(inst - code.data());
+		JUMP(inst->value);
+	}
+	DISPATCH();
+
+DO_INCR:
+	tape[ptr + inst->lRef] += inst->value;
+	DISPATCH();
+
+DO_INCR_MUL:
+	tape[ptr + inst->lRef] += inst->value * tape[ptr + inst->ref];
+	DISPATCH();
+
+DO_INCR_POLY:
+	tape[ptr + inst->lRef] += product<Cell>(bc, *inst, tape, ptr);
+	DISPATCH();
 
-	Program p(args);
+DO_DEBUG:
+	out.flush();
+	std::cout << "tape[" << ptr << "] = " << (int)tape[ptr] << std::endl;
+	DISPATCH();
+
+DO_HALT:
+	return;
+
+#undef JUMP
+#undef DISPATCH
+}
+
+template <CellType Cell> int interpret(const Args& args) {
+	Program<Cell> p(args);
 
 	if (!p.isOK()) {
 		std::cerr << p.error() << "\n";
 		return 1;
 	}
 
-	auto& code = p.instructions();
+	const auto code = lower(p.instructions());
+
+	OutputBuffer out(args.bufferedOutput);
+	InputBuffer in(out, args.eof);
+	const auto scan = scanKernel<Cell>(args.isa);
+
+	auto execute = [&](auto& profile) {
+		if (args.threadedDispatch) {
+			runThreaded<Cell>(code, profile, out, in, scan);
+		} else {
+			run<Cell>(code, profile, out, in, scan);
+		}
+		out.flush();
+	};
 
 	if (args.profile) {
-		auto counts = run(code);
-		p.printProfileInfo(counts);
+		Profile profile(code);
+		execute(profile);
+		p.printProfileInfo(profile.counts(code));
 	} else {
-		run(code);
+		NoProfile profile(code);
+		execute(profile);
 	}
 
 	return 0;
 }
+
+int main(int argc, char* argv[]) {
+	auto args = argparse(argc, argv);
+
+	switch (args.cellWidth) {
+		case 16:
+			return interpret<std::uint16_t>(args);
+		case 32:
+			return interpret<std::uint32_t>(args);
+		default:
+			return interpret<std::uint8_t>(args);
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <array>
+#include <cstddef>
+
+#include "util.hpp"
+
+// Size of the blocks bfi and the code generated by bfc hand to write(2)
+constexpr auto IO_BUFFER_SIZE = 1u << 16;
+
+// Output of WRITE. Bytes are collected and handed to write(2) in large
+// blocks; the owner flushes before blocking on input and at exit. With
+// buffering disabled every byte is written as soon as it is produced.
+class OutputBuffer {
+	std::array<char, IO_BUFFER_SIZE> buffer{};
+	std::size_t size = 0;
+	bool buffered;
+
+   public:
+	explicit OutputBuffer(bool buffered) : buffered(buffered) {}
+	OutputBuffer(const OutputBuffer&) = delete;
+	OutputBuffer& operator=(const OutputBuffer&) = delete;
+	~OutputBuffer() { flush(); }
+
+	void put(char ch) {
+		buffer[size++] = ch;
+		if (size == buffer.size() || !buffered) { flush(); }
+	}
+
+	void flush() {
+		std::size_t done = 0;
+		while (done < size) {
+			auto n = ::write(STDOUT_FILENO, buffer.data() + done, size - done);
+			if (n <= 0) { break; }
+			done += n;
+		}
+		size = 0;
+	}
+};
+
+// Input of READ. The buffer is refilled from stdin with a single read(2)
+// once it runs dry, and only then is pending output flushed, as that is
+// the only point where the program can block waiting for its user.
+class InputBuffer {
+	std::array<char, IO_BUFFER_SIZE> buffer{};
+	std::size_t pos = 0;
+	std::size_t size = 0;
+	OutputBuffer& out;
+	EOFPolicy eof;
+
+	bool refill() {
+		out.flush();
+		auto n = ::read(STDIN_FILENO, buffer.data(), buffer.size());
+		if (n <= 0) { return false; }
+		pos = 0;
+		size = n;
+		return true;
+	}
+
+   public:
+	InputBuffer(OutputBuffer& out, EOFPolicy eof) : out(out), eof(eof) {}
+	InputBuffer(const InputBuffer&) = delete;
+	InputBuffer& operator=(const InputBuffer&) = delete;
+
+	template <typename T> void read(T& cell) {
+		if (pos == size && !refill()) {
+			if (eof == EOFPolicy::ZERO) {
+				cell = 0;
+			} else if (eof == EOFPolicy::MINUS_ONE) {
+				cell = -1;
+			}
+			return;
+		}
+		cell = static_cast<unsigned char>(buffer[pos++]);
+	}
+};
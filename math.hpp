@@ -2,11 +2,51 @@
 
 #include <gmpxx.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <ostream>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
+#include "util.hpp"
+
+// Thrown by CheckedInt when a result does not fit in it
+struct IntegerOverflow : std::overflow_error {
+	IntegerOverflow() : std::overflow_error("integer overflow") {}
+};
+
+// 64-bit integer throwing IntegerOverflow instead of wrapping around, for
+// arithmetic that nearly always fits and can be done again with mpz_class
+// when it does not
+class CheckedInt {
+	std::int64_t v = 0;
+
+   public:
+	CheckedInt() = default;
+	CheckedInt(std::int64_t v) : v(v) {}
+	explicit CheckedInt(const mpz_class& z) {
+		if (!z.fits_slong_p()) { throw IntegerOverflow(); }
+		v = z.get_si();
+	}
+
+	CheckedInt& operator+=(CheckedInt o) {
+		if (__builtin_add_overflow(v, o.v, &v)) { throw IntegerOverflow(); }
+		return *this;
+	}
+	friend CheckedInt operator*(CheckedInt a, CheckedInt b) {
+		std::int64_t r = 0;
+		if (__builtin_mul_overflow(a.v, b.v, &r)) { throw IntegerOverflow(); }
+		return r;
+	}
+	bool operator==(const CheckedInt&) const = default;
+
+	explicit operator mpz_class() const {
+		return mpz_class(static_cast<long>(v));
+	}
+};
+
 using D = mpq_class;
 class Matrix {
 	std::vector<std::vector<D>> mat;
@@ -51,34 +91,178 @@ std::ostream& operator<<(std::ostream& os, const Matrix& m) {
 
 enum GaussianResult : std::uint8_t {
 	ONE_SOLUTION = 0,
-	MANY_SOLUTIONS,	 // Tape Movement
-	NO_SOLUTION,	 // Increment by product of constant and reference
+	MANY_SOLUTIONS,
+	NO_SOLUTION,
 };
-std::pair<GaussianResult, Matrix> gaussian(Matrix A, Matrix b) {
-	assert(A.rows() == b.rows());
 
-	// S = # samples
-	// N = # coeffs to solve for
-	// M = # distinct linear systems to solve
+// Bareiss' fraction-free Gauss-Jordan elimination of [A | b] over the
+// integers. Each step divides exactly by the previous pivot, so no entry
+// ever becomes a fraction and every pivot row ends up with the determinant
+// d on the diagonal and d * x next to it. Rows are swapped to find a pivot,
+// a column without one means A is singular.
+std::pair<GaussianResult, Matrix> bareiss(const Matrix& A, const Matrix& b) {
+	assert(A.rows() == b.rows());
 
 	const auto S = A.rows();
 	const auto N = A.cols();
 	const auto M = b.cols();
-	for (auto i = 0u; i < S && i < N; ++i) {
-		if (A[i][i] == 0) { return {MANY_SOLUTIONS, {0, 0}}; }
-		auto t = A[i][i];
-		for (auto j = 0u; j < N; ++j) { A[i][j] /= t; }
-		for (auto j = 0u; j < M; ++j) { b[i][j] /= t; }
-		for (auto k = 0u; k < S; ++k) {
+	if (S < N) { return {MANY_SOLUTIONS, {0, 0}}; }
+
+	// fractions in the input are cleared row by row first
+	std::vector<std::vector<mpz_class>> m(S, std::vector<mpz_class>(N + M));
+	for (auto i = 0u; i < S; ++i) {
+		mpz_class scale = 1;
+		for (auto j = 0u; j < N + M; ++j) {
+			const auto& e = j < N ? A[i][j] : b[i][j - N];
+			mpz_lcm(scale.get_mpz_t(), scale.get_mpz_t(), e.get_den_mpz_t());
+		}
+		for (auto j = 0u; j < N + M; ++j) {
+			const auto& e = j < N ? A[i][j] : b[i][j - N];
+			m[i][j] = scale / e.get_den() * e.get_num();
+		}
+	}
+
+	mpz_class previous = 1;
+	for (auto k = 0u; k < N; ++k) {
+		auto pivot = k;
+		while (pivot < S && m[pivot][k] == 0) { ++pivot; }
+		if (pivot == S) { return {MANY_SOLUTIONS, {0, 0}}; }
+		std::swap(m[k], m[pivot]);
+		for (auto i = 0u; i < S; ++i) {
 			if (i == k) { continue; }
-			t = A[k][i];
-			for (auto j = 0u; j < N; ++j) { A[k][j] -= t * A[i][j]; }
-			for (auto j = 0u; j < M; ++j) { b[k][j] -= t * b[i][j]; }
+			for (auto j = 0u; j < N + M; ++j) {
+				if (j == k) { continue; }
+				m[i][j] = m[k][k] * m[i][j] - m[i][k] * m[k][j];
+				mpz_divexact(
+					m[i][j].get_mpz_t(), m[i][j].get_mpz_t(),
+					previous.get_mpz_t());
+			}
+			m[i][k] = 0;
 		}
+		previous = m[k][k];
 	}
 	for (auto i = N; i < S; ++i) {
-		if (!b.isRowZero(i)) { return {NO_SOLUTION, {0, 0}}; }
+		for (auto j = N; j < N + M; ++j) {
+			if (m[i][j] != 0) { return {NO_SOLUTION, {0, 0}}; }
+		}
+	}
+
+	Matrix x(N, M);
+	for (auto i = 0u; i < N; ++i) {
+		for (auto j = 0u; j < M; ++j) {
+			x[i][j] = D(m[i][N + j], previous);
+			x[i][j].canonicalize();
+		}
+	}
+	return {ONE_SOLUTION, x};
+}
+
+// Arithmetic modulo the Mersenne prime 2^61 - 1, products fit in 128 bits
+struct Modular {
+	static constexpr std::uint64_t P = (std::uint64_t{1} << 61) - 1;
+
+	static std::uint64_t add(std::uint64_t a, std::uint64_t b) {
+		return (a + b) % P;
+	}
+	static std::uint64_t sub(std::uint64_t a, std::uint64_t b) {
+		return (a + P - b) % P;
+	}
+	static std::uint64_t mul(std::uint64_t a, std::uint64_t b) {
+		return static_cast<std::uint64_t>(
+			static_cast<unsigned __int128>(a) * b % P);
+	}
+	static std::uint64_t inverse(std::uint64_t a) {
+		std::uint64_t r = 1;
+		for (auto e = P - 2; e; e >>= 1) {
+			if (e & 1) { r = mul(r, a); }
+			a = mul(a, a);
+		}
+		return r;
+	}
+	static std::uint64_t of(const mpz_class& v) {
+		return mpz_fdiv_ui(v.get_mpz_t(), P);
+	}
+	// Representative closest to 0
+	static std::int64_t toSigned(std::uint64_t v) {
+		return v > P / 2 ? static_cast<std::int64_t>(v) -
+							   static_cast<std::int64_t>(P)
+						 : static_cast<std::int64_t>(v);
+	}
+};
+
+// Gauss-Jordan elimination of [A | b] modulo a word sized prime, with no
+// allocation past the copy of the system. The elimination tells whether A is
+// singular with high probability only, and it finds integer solutions only,
+// so the result is checked against the system exactly and anything else is
+// left to bareiss.
+std::pair<GaussianResult, Matrix> modular(const Matrix& A, const Matrix& b) {
+	assert(A.rows() == b.rows());
+
+	const auto S = A.rows();
+	const auto N = A.cols();
+	const auto M = b.cols();
+	if (S < N) { return {MANY_SOLUTIONS, {0, 0}}; }
+
+	std::vector<std::uint64_t> m(S * (N + M));
+	auto at = [&](size_t i, size_t j) -> std::uint64_t& {
+		return m[i * (N + M) + j];
+	};
+	for (auto i = 0u; i < S; ++i) {
+		for (auto j = 0u; j < N + M; ++j) {
+			const auto& e = j < N ? A[i][j] : b[i][j - N];
+			if (e.get_den() != 1) { return bareiss(A, b); }
+			at(i, j) = Modular::of(e.get_num());
+		}
+	}
+
+	for (auto k = 0u; k < N; ++k) {
+		auto pivot = k;
+		while (pivot < S && at(pivot, k) == 0) { ++pivot; }
+		if (pivot == S) { return bareiss(A, b); }
+		const auto t = Modular::inverse(at(pivot, k));
+		for (auto j = 0u; j < N + M; ++j) {
+			std::swap(at(k, j), at(pivot, j));
+			at(k, j) = Modular::mul(at(k, j), t);
+		}
+		for (auto i = 0u; i < S; ++i) {
+			if (i == k || at(i, k) == 0) { continue; }
+			const auto f = at(i, k);
+			for (auto j = 0u; j < N + M; ++j) {
+				at(i, j) = Modular::sub(at(i, j), Modular::mul(f, at(k, j)));
+			}
+		}
+	}
+
+	Matrix x(N, M);
+	for (auto i = 0u; i < N; ++i) {
+		for (auto j = 0u; j < M; ++j) {
+			x[i][j] = Modular::toSigned(at(i, N + j));
+		}
+	}
+	mpz_class sum;
+	for (auto i = 0u; i < S; ++i) {
+		for (auto j = 0u; j < M; ++j) {
+			sum = 0;
+			for (auto k = 0u; k < N; ++k) {
+				mpz_addmul(
+					sum.get_mpz_t(), A[i][k].get_num_mpz_t(),
+					x[k][j].get_num_mpz_t());
+			}
+			if (sum != b[i][j].get_num()) { return bareiss(A, b); }
+		}
+	}
+	return {ONE_SOLUTION, x};
+}
+
+// Solves A x = b for every column of b, A having at least as many rows as
+// columns
+std::pair<GaussianResult, Matrix> gaussian(
+	const Matrix& A, const Matrix& b, Solver solver = Solver::MODULAR) {
+	switch (solver) {
+		case Solver::BAREISS:
+			return bareiss(A, b);
+		case Solver::MODULAR:
+			return modular(A, b);
 	}
-	b.resize(N, M);
-	return {ONE_SOLUTION, b};
+	return bareiss(A, b);
 }
@@ -1,23 +1,46 @@
+#pragma once
+
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <concepts>
+#include <cstdint>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <mutex>
 #include <optional>
-#include <random>
 #include <set>
 #include <span>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
+#include "containers.hpp"
 #include "math.hpp"
+#include "source.hpp"
 #include "util.hpp"
 
-using DATA_TYPE = unsigned char;
 // #define LOG_INST 1
 
+// Cell types the tape can be made of, selected with --cell-width
+template <typename T>
+concept CellType = std::same_as<T, std::uint8_t> ||
+				   std::same_as<T, std::uint16_t> ||
+				   std::same_as<T, std::uint32_t>;
+
+// Representative of `v` modulo the cell size closest to 0, so that a run of
+// 255 '+' on 8-bit cells reads as -1 like a single '-'
+template <CellType Cell> int wrap(int v) {
+	return static_cast<std::make_signed_t<Cell>>(static_cast<Cell>(v));
+}
+
 enum Inst_Codes : std::int8_t {
 	NO_OP = 0,
 	TAPE_M,	 // Tape Movement
@@ -28,17 +51,21 @@ enum Inst_Codes : std::int8_t {
 	JUMP_C,		   // Jump to closing bracket
 	JUMP_O,		   // Jump to opening bracket
 	SCAN,		   // Scan for 0
-	WRITE_LOCK,	   // stop writes to cell, storing writes in a temp cell
-	WRITE_UNLOCK,  // set value from temp cell and enable writes to cell
+	LINEAR,		   // Parallel assignment by the next `value` INCR/SET_C
+	BLOCK,		   // Vector update of the cells of the next `value` INCR/SET_C
+	SWEEP,		   // Loop of the next `value` INCR/SET_C moving by `lRef`
 	DEBUG,
 	HALT,
 };
 
+// Cells an INCR multiplies with, nearly always no more than two
+using Operands = SmallVector<int, 2>;
+
 struct Instruction {
 	Inst_Codes code = Inst_Codes::NO_OP;
 	int lRef = 0;
 	int value = 0;
-	std::vector<int> rRef;
+	Operands rRef;
 };
 
 Instruction getInstruction(char ch) {
@@ -81,9 +108,9 @@ std::ostream& operator<<(std::ostream& os, const Instruction& a) {
 			for (const auto& e : a.rRef) { os << "*p[" << e << "]"; }
 			return os << ")";
 		case WRITE:
-			return os << "WRITE";
+			return os << "WRITE(p[" << a.lRef << "])";
 		case READ:
-			return os << "READ";
+			return os << "READ(p[" << a.lRef << "])";
 		case DEBUG:
 			return os << "DEBUG";
 		case SCAN:
@@ -100,11 +127,12 @@ std::ostream& operator<<(std::ostream& os, const Instruction& a) {
 			return os << "NO_OP";
 		case TAPE_M:
 			return os << "MOV(" << a.value << ")";
-		case WRITE_LOCK:
-			return os << "W_LOCK(" << a.lRef << ")";
-		case WRITE_UNLOCK:
-			return os << "W_UNLOCK(" << a.lRef << ")";
-			break;
+		case LINEAR:
+			return os << "LINEAR(" << a.value << ")";
+		case BLOCK:
+			return os << "BLOCK(p[" << a.lRef << "]," << a.value << ")";
+		case SWEEP:
+			return os << "SWEEP(" << a.lRef << "," << a.value << ")";
 	}
 	return os;
 }
@@ -113,8 +141,8 @@ struct CodeInfo {
 	bool loop = false, innerMost = false, complex = false, empty = true,
 		 hasJumps = false;
 	int shift = 0;
-	std::map<int, int> delta;
-	std::map<int, std::set<int>> parent;
+	FlatMap<int, int> delta;
+	FlatMap<int, FlatSet<int>> parent;
 };
 
 CodeInfo codeInfo(std::span<Instruction> code) {
@@ -127,6 +155,7 @@ CodeInfo codeInfo(std::span<Instruction> code) {
 	for (auto& e : code) {
 		switch (e.code) {
 			case SCAN:
+			case SWEEP:
 			case WRITE:
 			case READ:
 			case DEBUG:
@@ -138,7 +167,7 @@ CodeInfo codeInfo(std::span<Instruction> code) {
 				break;
 			case INCR:
 				if (e.rRef.empty()) {
-					delta[info.shift] += e.value;
+					delta[info.shift + e.lRef] += e.value;
 				} else {
 					for (auto& r : e.rRef) {
 						info.parent[info.shift + e.lRef].insert(info.shift + r);
@@ -154,8 +183,8 @@ CodeInfo codeInfo(std::span<Instruction> code) {
 				info.hasJumps = true;
 				break;
 			case NO_OP:
-			case WRITE_LOCK:
-			case WRITE_UNLOCK:
+			case LINEAR:
+			case BLOCK:
 				break;
 		}
 	}
@@ -191,11 +220,111 @@ bool isScanLoop(const CodeInfo& info) {
 		   info.parent.empty();
 }
 
-bool mockRunner(std::span<Instruction> code, std::map<int, mpz_class>& tape) {
+// Polynomial in the cells a loop starts with, a product of cells is the
+// sorted offsets of its factors. Monomials with a coefficient of 0 are
+// dropped.
+using Monomial = SmallVector<int, 4>;
+template <typename C> using Polynomial = FlatMap<Monomial, C>;
+
+// Monomials a polynomial may have before the loop is not worth solving
+constexpr auto TERM_LIMIT = 64u;
+
+template <typename C> Polynomial<C> constant(const C& c) {
+	if (c == 0) { return {}; }
+	return {{{}, c}};
+}
+
+template <typename C> bool isConstant(const Polynomial<C>& p) {
+	return p.empty() || (p.size() == 1 && p.begin()->first.empty());
+}
+
+template <typename C> void add(Polynomial<C>& a, const Polynomial<C>& b) {
+	for (const auto& [m, c] : b) {
+		auto& e = a[m];
+		e += c;
+		if (e == 0) { a.erase(m); }
+	}
+}
+
+// The products of every pair of terms are sorted first, so that like terms
+// are next to each other and the result is built in order
+template <typename C>
+Polynomial<C> multiply(const Polynomial<C>& a, const Polynomial<C>& b) {
+	std::vector<std::pair<Monomial, C>> terms;
+	terms.reserve(a.size() * b.size());
+	for (const auto& [m, c] : a) {
+		for (const auto& [n, d] : b) {
+			Monomial mn;
+			mn.reserve(m.size() + n.size());
+			std::merge(
+				m.begin(), m.end(), n.begin(), n.end(), std::back_inserter(mn));
+			terms.emplace_back(std::move(mn), c * d);
+		}
+	}
+	std::ranges::sort(terms, {}, &std::pair<Monomial, C>::first);
+	Polynomial<C> r;
+	for (auto itr = terms.begin(); itr != terms.end();) {
+		auto next = std::next(itr);
+		for (; next != terms.end() && next->first == itr->first; ++next) {
+			itr->second += next->second;
+		}
+		if (itr->second != 0) {
+			r.try_emplace(itr->first, std::move(itr->second));
+		}
+		itr = next;
+	}
+	return r;
+}
+
+// The cells from the lowest to the highest of `variables`, which are all the
+// cells a loop touches, as polynomials. Each of the `variables` starts out
+// as itself.
+template <typename C> class MockTape {
+	int low;
+	std::vector<Polynomial<C>> cells;
+
+   public:
+	explicit MockTape(const FlatSet<int>& variables)
+		: low(*variables.begin()),
+		  cells(*variables.rbegin() - *variables.begin() + 1) {
+		for (const auto& v : variables) { cells[v - low] = {{{v}, 1}}; }
+	}
+
+	Polynomial<C>& operator[](int c) {
+		assert(c >= low && c - low < static_cast<int>(cells.size()));
+		return cells[c - low];
+	}
+	const Polynomial<C>& operator[](int c) const {
+		assert(c >= low && c - low < static_cast<int>(cells.size()));
+		return cells[c - low];
+	}
+};
+
+// `p` with every cell replaced by the polynomial `values` has for it
+template <typename C>
+Polynomial<C> substitute(const Polynomial<C>& p, const MockTape<C>& values) {
+	Polynomial<C> r;
+	for (const auto& [m, c] : p) {
+		auto t = constant(c);
+		for (const auto& v : m) { t = multiply(t, values[v]); }
+		add(r, t);
+	}
+	return r;
+}
+
+// Runs `code` on a tape of polynomials, loops can only be followed while
+// the cells they test are constants
+template <typename C>
+bool mockRunner(std::span<Instruction> code, MockTape<C>& tape) {
 	int ptr = 0;
 	int count = 0;
-	std::map<int, mpz_class> tempTape;
+	std::vector<Polynomial<C>> scratch;
 	constexpr auto LOOP_LIMIT = 512;
+	auto product = [&](const Instruction& i) {
+		auto t = constant(C(i.value));
+		for (const auto& r : i.rRef) { t = multiply(t, tape[ptr + r]); }
+		return t;
+	};
 	for (auto itr = code.begin(); itr != code.end(); itr++) {
 		if (count >= LOOP_LIMIT) { return false; }
 		const auto& i = *itr;
@@ -204,47 +333,56 @@ bool mockRunner(std::span<Instruction> code, std::map<int, mpz_class>& tape) {
 				ptr += i.value;
 				break;
 
-			case WRITE_LOCK:
-				tempTape[ptr + i.lRef] = tape[ptr + i.lRef];
-				break;
-			case WRITE_UNLOCK:
-				tape[ptr + i.lRef] = tempTape[ptr + i.lRef];
-				tempTape.erase(ptr + i.lRef);
+			case LINEAR: {
+				// compute every right hand side first, then store them all
+				auto members = std::span(itr + 1, itr + 1 + i.value);
+				scratch.resize(members.size());
+				for (auto k = 0u; k < members.size(); ++k) {
+					scratch[k] = product(members[k]);
+				}
+				for (auto k = 0u; k < members.size(); ++k) {
+					auto& cell = tape[ptr + members[k].lRef];
+					if (members[k].code == SET_C) {
+						cell = std::move(scratch[k]);
+					} else {
+						add(cell, scratch[k]);
+					}
+					if (cell.size() > TERM_LIMIT) { return false; }
+				}
+				itr += i.value;
 				break;
+			}
 
 			case SET_C:
-				if (tempTape.contains(ptr + i.lRef)) {
-					tempTape[ptr + i.lRef] = i.value;
-				} else {
-					tape[ptr + i.lRef] = i.value;
-				}
+				tape[ptr + i.lRef] = constant(C(i.value));
 				break;
 
 			case JUMP_C:
-				if (tape[ptr] == 0) { itr += i.value; }
+				if (!isConstant(tape[ptr])) { return false; }
+				if (tape[ptr].empty()) { itr += i.value; }
 				break;
 
 			case JUMP_O:
-				if (tape[ptr] != 0) {
+				if (!isConstant(tape[ptr])) { return false; }
+				if (!tape[ptr].empty()) {
 					itr += i.value;
 					count++;
 				}
 				break;
 
 			case INCR: {
-				mpz_class t = i.value;
-				for (const auto& r : i.rRef) { t *= tape[ptr + r]; }
-				if (tempTape.contains(ptr + i.lRef)) {
-					tempTape[ptr + i.lRef] += t;
-				} else {
-					tape[ptr + i.lRef] += t;
-				}
+				auto t = product(i);
+				auto& cell = tape[ptr + i.lRef];
+				add(cell, t);
+				if (cell.size() > TERM_LIMIT) { return false; }
 				break;
 			}
 
 			case NO_OP:
+			case BLOCK:
 				break;
 			case SCAN:
+			case SWEEP:
 			case WRITE:
 			case READ:
 			case DEBUG:
@@ -255,71 +393,7 @@ bool mockRunner(std::span<Instruction> code, std::map<int, mpz_class>& tape) {
 	return true;
 }
 
-constexpr auto VARIABLE_LIMIT = 20u;
-
-auto solve(
-	std::span<Instruction> code, const std::set<std::multiset<int>>& terms,
-	const std::set<int>& variables) {
-	Matrix x(0, 0);
-
-	if (terms.size() > VARIABLE_LIMIT || terms.empty()) { return x; }
-	const int N = static_cast<int>(terms.size()),
-			  M = static_cast<int>(variables.size()), S = N + 1;
-
-	// S = # samples
-	// N = # coeffs to solve for
-	// M = # distinct linear systems to solve. one for each variable
-
-	// Matrix for solving Ax = b
-	Matrix A(S, N), b(S, M);
-
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> d(1, N * N);
-
-	std::map<int, mpz_class> tape;
-
-	// std::vector<std::vector<int>> points = {
-	// };
-
-	GaussianResult res = MANY_SOLUTIONS;
-
-	while (res == MANY_SOLUTIONS) {
-		for (auto i = 0; i < S; ++i) {
-			// Set Tape with random numbers
-			for (const auto& e : variables) {  //
-				tape[e] = d(gen);
-			}
-
-			// for (int j = 0; const auto& e : variables) {  //
-			// 	tape[e] = points[i][j++];
-			// }
-
-			for (int j = 0; const auto& e : terms) {
-				A[i][j] = 1;
-				for (const auto& f : e) { A[i][j] *= tape[f]; }
-				j++;
-			}
-
-			if (!mockRunner(code, tape)) { return x; }
-			for (int j = 0; const auto& e : variables) {  //
-				b[i][j++] = tape[e];
-			}
-		}
-
-		std::tie(res, x) = gaussian(A, b);
-	}
-	// debug("A = %", A);
-	// debug("b = %", b);
-	// debug("x = %", x);
-
-	// its easier to process transposed x
-	return x.T();
-}
-
-bool extractVariables(
-	std::span<Instruction> code, std::set<std::multiset<int>>& terms,
-	std::set<int>& variables) {
+bool extractVariables(std::span<Instruction> code, FlatSet<int>& variables) {
 	code = code.subspan(1, code.size() - 2);
 	if (code.empty()) { return false; }
 	int shift = 0;
@@ -330,27 +404,16 @@ bool extractVariables(
 				break;
 			}
 			case INCR: {
-				std::multiset<int> term;
-				for (auto& e : i.rRef) {
-					term.insert(e + shift);
-					variables.insert(e + shift);
-				}
-				terms.insert(term);
-				term.insert(0);
-				terms.insert(term);
-				terms.insert({i.lRef + shift});
+				for (auto& e : i.rRef) { variables.insert(e + shift); }
 				variables.insert(i.lRef + shift);
 				break;
 			}
 			case SET_C: {
-				terms.insert({});
-				terms.insert({0});
-				terms.insert({i.lRef + shift});
 				variables.insert(i.lRef + shift);
 				break;
 			}
-			case WRITE_LOCK:
-			case WRITE_UNLOCK:
+			case LINEAR:
+			case BLOCK:
 			case NO_OP:
 				break;
 			case WRITE:
@@ -358,108 +421,152 @@ bool extractVariables(
 			case JUMP_C:
 			case JUMP_O:
 			case SCAN:
+			case SWEEP:
 			case DEBUG:
 			case HALT:
 				return false;
 		}
 	}
-	if (terms.empty()) { return false; }
+	if (variables.empty()) { return false; }
 	variables.insert(0);
-	{
-		auto degree = terms.begin()->size();
-		for (const auto& e : terms) { degree = std::max(degree, e.size()); }
-		std::multiset<int> term;
-		for (auto i = 0u; i < degree; ++i) {
-			term.insert(0);
-			terms.insert(term);
-		}
-	}
 	return shift == 0;
 }
 
-auto rowToExpr(const std::set<std::multiset<int>>& terms, auto& row) {
-	std::map<std::multiset<int>, mpq_class> expr;
-	for (int i = 0; const auto& e : terms) {
-		if (row[i] != 0) { expr[e] = row[i]; }
-		i++;
-	}
-	return expr;
-}
-
-// check if the loop body makes this change
+// What one run of the loop body leaves in each of the `variables`, if it
+// makes this change
 // w = w - 1
-bool checkLoopBody(
-	std::span<Instruction> code, const std::set<std::multiset<int>>& terms,
-	const std::set<int>& variables) {
-	auto loopBody = code.subspan(1, code.size() - 2);
-
-	auto x = solve(loopBody, terms, variables);
-	if (x.rows() == 0) { return false; }
-	int loopVariable = 0;
-	for (const auto& e : variables) {
-		if (e == 0) { break; }
-		loopVariable++;
-	}
-	std::map<std::multiset<int>, mpq_class> want;
-	want[{}] = -1;
-	want[{0}] = 1;
-	// want = p[0] - 1;
-	return rowToExpr(terms, x[loopVariable]) == want;
+template <typename C>
+std::optional<MockTape<C>> checkLoopBody(
+	std::span<Instruction> code, const FlatSet<int>& variables) {
+	MockTape<C> tape(variables);
+	if (!mockRunner(code.subspan(1, code.size() - 2), tape)) { return {}; }
+	if (tape[0] != Polynomial<C>{{{}, -1}, {{0}, 1}}) { return {}; }
+	return tape;
 }
 
-auto computeExpressions(
-	const Matrix& x, const std::set<std::multiset<int>>& terms,
-	const std::set<int>& variables) {
-	std::vector<std::map<std::multiset<int>, mpq_class>> expressions(
-		variables.size());
-	for (auto i = 0u; const auto& v : variables) {
-		expressions[i] = rowToExpr(terms, x[i]);
-		// We can only increment tape cells, so subtract cell from it
-		expressions[i][{v}]--;
-		if (expressions[i][{v}] == 0) {	 //
-			expressions[i].erase({v});
+// Highest degree in p[0] tried for what a loop leaves in a cell
+constexpr auto DEGREE_LIMIT = 8u;
+
+// What the loop leaves in each of the `variables`. The loop is run with
+// p[0] = 1, 2, ... and the other cells left symbolic, and what it leaves is
+// fitted to polynomials in p[0] of growing degree, with one run more than the
+// fit needs to check it. A fit F is only taken once it is proven: F(1) is
+// one run of the body, and F(p[0]) equals F(p[0] - 1) applied after one run
+// of the body.
+template <typename C>
+std::optional<FlatMap<int, Polynomial<mpz_class>>> solve(
+	std::span<Instruction> code, const FlatSet<int>& variables,
+	Solver solver) {
+	auto body = checkLoopBody<C>(code, variables);
+	if (!body) { return {}; }
+
+	std::vector<MockTape<C>> runs;
+	for (std::size_t degree = 1; degree <= DEGREE_LIMIT; ++degree) {
+		while (runs.size() < degree + 2) {
+			MockTape<C> tape(variables);
+			tape[0] = constant(C(static_cast<int>(runs.size() + 1)));
+			if (!mockRunner(code, tape)) { return {}; }
+			runs.push_back(std::move(tape));
 		}
-		i++;
-	}
-	return expressions;
-}
 
-bool linearTest(
-	std::span<Instruction> code, std::vector<Instruction>& newCode) {
-	std::set<std::multiset<int>> terms;
-	std::set<int> variables;
+		// one system for each monomial of the other cells in each variable
+		std::vector<std::pair<int, Monomial>> columns;
+		for (const auto& v : variables) {
+			std::vector<Monomial> monomials;
+			for (const auto& run : runs) {
+				for (const auto& e : run[v]) { monomials.push_back(e.first); }
+			}
+			std::ranges::sort(monomials);
+			monomials.erase(
+				std::unique(monomials.begin(), monomials.end()),
+				monomials.end());
+			for (auto& m : monomials) { columns.emplace_back(v, std::move(m)); }
+		}
 
-	if (!extractVariables(code, terms, variables)) { return false; }
+		const auto S = runs.size(), N = degree + 1, M = columns.size();
+		Matrix A(S, N), b(S, M);
+		for (auto i = 0u; i < S; ++i) {
+			for (auto j = 0u; j < N; ++j) {
+				mpz_ui_pow_ui(A[i][j].get_num_mpz_t(), i + 1, j);
+			}
+			for (auto k = 0u; k < M; ++k) {
+				const auto& [v, m] = columns[k];
+				auto e = runs[i][v].find(m);
+				if (e != runs[i][v].end()) { b[i][k] = mpz_class(e->second); }
+			}
+		}
+		auto [res, x] = gaussian(A, b, solver);
+		if (res == MANY_SOLUTIONS) { return {}; }
+		if (res == NO_SOLUTION) { continue; }
+
+		// the loop can only become instructions with integer coefficients
+		FlatMap<int, Polynomial<C>> loop;
+		for (const auto& v : variables) { loop[v]; }
+		for (auto k = 0u; k < M; ++k) {
+			auto [v, m] = columns[k];
+			for (auto j = 0u; j < N; ++j) {
+				if (x[j][k].get_den() != 1) { return {}; }
+				if (x[j][k] != 0) { loop[v][m] = C(x[j][k].get_num()); }
+				m.insert(std::ranges::upper_bound(m, 0), 0);
+			}
+		}
 
-	if (!checkLoopBody(code, terms, variables)) { return false; }
+		auto proven = true;
+		for (const auto& [v, p] : loop) {
+			if (substitute(p, *body) != p) {
+				proven = false;
+				break;
+			}
+		}
+		if (!proven) { continue; }
 
-	// Finally solve for loop
-	auto x = solve(code, terms, variables);
+		FlatMap<int, Polynomial<mpz_class>> result;
+		for (const auto& [v, p] : loop) {
+			auto& r = result[v];
+			for (const auto& [m, c] : p) { r[m] = mpz_class(c); }
+		}
+		return result;
+	}
+	return {};
+}
 
-	if (x.rows() == 0) { return false; }
+bool linearTest(
+	std::span<Instruction> code, std::vector<Instruction>& newCode,
+	Solver solver) {
+	FlatSet<int> variables;
+
+	if (!extractVariables(code, variables)) { return false; }
+
+	// Finally solve for loop. Coefficients nearly always fit in 64 bits, it is
+	// all done again on bignums when one does not.
+	std::optional<FlatMap<int, Polynomial<mpz_class>>> loop;
+	try {
+		loop = solve<CheckedInt>(code, variables, solver);
+	} catch (const IntegerOverflow&) {
+		loop = solve<mpz_class>(code, variables, solver);
+	}
+	if (!loop) { return false; }
 
-	// The matrix can have fractional elements,
-	// but we can't handle them for now, so return false
-	// Also, matrix elements has arbitrary precision integer
-	// so need to reject elements out of range
-	for (auto i = 0u; i < x.rows(); ++i) {
-		for (auto j = 0u; j < x.cols(); ++j) {
-			if (x[i][j].get_den() != 1) { return false; }
-			if (x[i][j] > INT_MAX || x[i][j] < INT_MIN) { return false; }
+	// Coefficients have arbitrary precision, so need to reject those out of
+	// range
+	for (const auto& [v, p] : *loop) {
+		for (const auto& [m, c] : p) {
+			if (!c.fits_sint_p()) { return false; }
 		}
 	}
 
 	newCode.push_back({JUMP_C, 0, 0, {}});
 
-	for (const auto& v : variables) {
-		newCode.push_back({WRITE_LOCK, v, 0, {}});
-	}
+	// every expression is in terms of the cells before the loop ran, so all
+	// of them become one parallel assignment
+	const auto linear = newCode.size();
+	newCode.push_back({LINEAR, 0, 0, {}});
 
-	auto expressions = computeExpressions(x, terms, variables);
 	bool canSkipCheck = true;
 
-	for (auto i = 0u; const auto& v : variables) {
-		auto& expr = expressions[i++];
+	for (auto& [v, expr] : *loop) {
+		// We can only increment tape cells, so subtract cell from it
+		add(expr, {{{v}, -1}});
 		if (expr.size() == 1 && expr.contains({v}) && expr[{v}] == -1) {
 			canSkipCheck = canSkipCheck && v == 0;
 			Instruction inst;
@@ -470,19 +577,17 @@ bool linearTest(
 			continue;
 		}
 		for (auto& [term, coeff] : expr) {
-			canSkipCheck = canSkipCheck && term.contains(0);
+			canSkipCheck = canSkipCheck && std::ranges::binary_search(term, 0);
 			Instruction inst;
 			inst.code = INCR;
 			inst.lRef = v;
-			inst.value = static_cast<int>(coeff.get_num().get_si());
+			inst.value = static_cast<int>(coeff.get_si());
 			inst.rRef.insert(inst.rRef.end(), term.begin(), term.end());
 			newCode.push_back(inst);
 		}
 	}
 
-	for (const auto& v : variables) {
-		newCode.push_back({WRITE_UNLOCK, v, 0, {}});
-	}
+	newCode[linear].value = static_cast<int>(newCode.size() - linear - 1);
 
 	if (canSkipCheck) {
 		newCode.erase(newCode.begin());
@@ -494,10 +599,513 @@ bool linearTest(
 	return true;
 }
 
-class Program {
+// Memo of linearTest by loop body, so that the copies of a loop generated
+// programs are full of only get solved once. The key is the body with the
+// pointer movements folded into the offsets. With --linear-cache the memo is
+// kept in a file from one run to the next. Loops can be linearized from
+// several threads, copies solved at the same time wait for the first one.
+class LinearCache {
+	static constexpr std::string_view HEADER = "bf-linear-cache 2";
+	struct Entry {
+		std::once_flag solved;
+		std::optional<std::vector<Instruction>> result;
+	};
+	std::map<std::string, Entry> entries;
+	std::mutex entriesLock;
+	std::atomic<bool> changed = false;
+
+	static void encode(std::ostream& os, const Instruction& i) {
+		os << ' ' << static_cast<int>(i.code) << ' ' << i.lRef << ' '
+		   << i.value << ' ' << i.rRef.size();
+		for (const auto& r : i.rRef) { os << ' ' << r; }
+	}
+
+	static bool decode(std::istream& is, Instruction& i) {
+		auto code = 0;
+		auto refs = 0u;
+		if (!(is >> code >> i.lRef >> i.value >> refs)) { return false; }
+		if (code < NO_OP || code > HALT) { return false; }
+		i.code = static_cast<Inst_Codes>(code);
+		i.rRef.clear();
+		for (auto r = 0; refs > 0 && is >> r; --refs) { i.rRef.push_back(r); }
+		return refs == 0;
+	}
+
+	// Nothing for the loops extractVariables rejects on sight
+	static std::optional<std::string> key(std::span<Instruction> code) {
+		std::ostringstream os;
+		auto shift = 0;
+		for (auto i : code.subspan(1, code.size() - 2)) {
+			switch (i.code) {
+				case TAPE_M:
+					shift += i.value;
+					continue;
+				case INCR:
+				case SET_C:
+					i.lRef += shift;
+					for (auto& r : i.rRef) { r += shift; }
+					break;
+				case NO_OP:
+					continue;
+				case LINEAR:
+				case BLOCK:
+					break;
+				case WRITE:
+				case READ:
+				case JUMP_C:
+				case JUMP_O:
+				case SCAN:
+				case SWEEP:
+				case DEBUG:
+				case HALT:
+					return std::nullopt;
+			}
+			encode(os, i);
+		}
+		if (shift != 0) { return std::nullopt; }
+		return os.str();
+	}
+
+   public:
+	bool linearize(
+		std::span<Instruction> code, std::vector<Instruction>& newCode,
+		Solver solver) {
+		auto k = key(code);
+		if (!k) { return false; }
+		Entry* entry = nullptr;
+		{
+			std::scoped_lock guard(entriesLock);
+			entry = &entries[std::move(*k)];
+		}
+		std::call_once(entry->solved, [&] {
+			std::vector<Instruction> result;
+			if (linearTest(code, result, solver)) {
+				entry->result = std::move(result);
+			}
+			changed = true;
+		});
+		if (!entry->result) { return false; }
+		newCode.insert(
+			newCode.end(), entry->result->begin(), entry->result->end());
+		return true;
+	}
+
+	// One entry per line, the key and the instructions of the result after
+	// a '|', or -1 for a rejected loop. Unreadable files and lines are
+	// skipped, they only cost the time to solve those loops again.
+	void load(const std::filesystem::path& path) {
+		std::ifstream file(path);
+		std::string line;
+		if (!std::getline(file, line) || line != HEADER) { return; }
+		while (std::getline(file, line)) {
+			auto bar = line.find('|');
+			if (bar == std::string::npos) { continue; }
+			std::istringstream is(line.substr(bar + 1));
+			auto count = 0;
+			if (!(is >> count)) { continue; }
+			std::optional<std::vector<Instruction>> result;
+			if (count >= 0) {
+				result.emplace();
+				Instruction inst;
+				for (; count > 0 && decode(is, inst); --count) {
+					result->push_back(inst);
+				}
+				if (count != 0) { continue; }
+			}
+			auto& entry = entries[line.substr(0, bar)];
+			std::call_once(
+				entry.solved, [&] { entry.result = std::move(result); });
+		}
+	}
+
+	void save(const std::filesystem::path& path) const {
+		if (!changed) { return; }
+		auto temp = path;
+		temp += ".tmp";
+		{
+			std::ofstream file(temp);
+			file << HEADER << "\n";
+			for (const auto& [k, entry] : entries) {
+				const auto& result = entry.result;
+				file << k << "|";
+				if (!result) {
+					file << -1 << "\n";
+					continue;
+				}
+				file << result->size();
+				for (const auto& i : *result) { encode(file, i); }
+				file << "\n";
+			}
+			if (!file) {
+				print(std::cerr, "cannot write file: '%'", temp.string());
+				return;
+			}
+		}
+		std::error_code ec;
+		std::filesystem::rename(temp, path, ec);
+		if (ec) { print(std::cerr, "cannot write file: '%'", path.string()); }
+	}
+};
+
+// A loop moving the pointer by the same amount every time and only adding
+// or setting constants on the way is a SWEEP, if each cell is changed by at
+// most one iteration and the cell tested next is not one of them. That is,
+// all changes land in the `shift` cells from the tested one towards where
+// the loop goes. The members are one INCR or SET_C per cell, sorted.
+template <CellType Cell>
+bool sweepTest(
+	const CodeInfo& info, std::span<Instruction> code,
+	std::vector<Instruction>& newCode) {
+	if (!info.loop || info.complex || info.hasJumps || info.shift == 0) {
+		return false;
+	}
+	std::map<int, std::pair<Inst_Codes, int>> cells;
+	auto shift = 0;
+	for (const auto& i : code.subspan(1, code.size() - 2)) {
+		switch (i.code) {
+			case TAPE_M:
+				shift += i.value;
+				break;
+			case INCR:
+				if (!i.rRef.empty()) { return false; }
+				cells.try_emplace(shift + i.lRef, INCR, 0)
+					.first->second.second += i.value;
+				break;
+			case SET_C:
+				cells[shift + i.lRef] = {SET_C, i.value};
+				break;
+			case NO_OP:
+				break;
+			case WRITE:
+			case READ:
+			case JUMP_C:
+			case JUMP_O:
+			case SCAN:
+			case LINEAR:
+			case BLOCK:
+			case SWEEP:
+			case DEBUG:
+			case HALT:
+				return false;
+		}
+	}
+
+	const auto low = std::min(0, shift + 1), high = std::max(0, shift - 1);
+	std::erase_if(cells, [](const auto& c) {
+		return c.second.first == INCR && wrap<Cell>(c.second.second) == 0;
+	});
+	if (cells.empty()) { return false; }
+	if (cells.begin()->first < low || cells.rbegin()->first > high) {
+		return false;
+	}
+
+	newCode.push_back({SWEEP, shift, static_cast<int>(cells.size()), {}});
+	for (const auto& [c, update] : cells) {
+		newCode.push_back({update.first, c, wrap<Cell>(update.second), {}});
+	}
+	return true;
+}
+
+// Recomputes the distance stored in every pair of matching jumps
+void matchJumps(std::span<Instruction> code) {
+	std::vector<int> stack;
+	for (auto i = 0; i < static_cast<int>(code.size()); ++i) {
+		if (code[i].code == JUMP_C) {
+			stack.push_back(i);
+		} else if (code[i].code == JUMP_O) {
+			code[i].value = stack.back() - i;
+			code[stack.back()].value = i - stack.back();
+			stack.pop_back();
+		}
+	}
+}
+
+// True if `a` and `b` update their cells the same way and can be members of
+// one BLOCK: both set a constant, both add a constant or both add a multiple
+// of the same cell
+bool sameUpdate(const Instruction& a, const Instruction& b) {
+	return a.code == b.code && a.rRef == b.rRef &&
+		   (a.code == SET_C || (a.code == INCR && a.rRef.size() <= 1));
+}
+
+constexpr auto MIN_BLOCK = 4;
+constexpr auto MAX_BLOCK_GAP = 2;
+
+// Rewrites a run of instructions with the same update as one instruction per
+// cell, sorted by cell. Cells no more than MAX_BLOCK_GAP apart go into one
+// window, windows of at least MIN_BLOCK cells get a BLOCK header.
+void fuseRun(std::span<Instruction> run, std::vector<Instruction>& newCode) {
+	const auto& kind = run.front();
+	std::map<int, int> cells;
+	for (const auto& i : run) {
+		if (kind.code == SET_C) {
+			cells[i.lRef] = i.value;
+		} else {
+			cells[i.lRef] += i.value;
+		}
+	}
+	// a member changing the cell all of them multiply with would be seen by
+	// the ones after it, not so by a vector of all of them
+	if (!kind.rRef.empty() && cells.contains(kind.rRef.front())) {
+		newCode.insert(
+			newCode.end(), std::make_move_iterator(run.begin()),
+			std::make_move_iterator(run.end()));
+		return;
+	}
+	if (kind.code == INCR) {
+		std::erase_if(cells, [](const auto& c) { return c.second == 0; });
+	}
+
+	for (auto itr = cells.begin(); itr != cells.end();) {
+		auto end = std::next(itr);
+		auto size = 1;
+		while (end != cells.end() &&
+			   end->first - std::prev(end)->first <= MAX_BLOCK_GAP) {
+			++end;
+			++size;
+		}
+		if (size >= MIN_BLOCK) {
+			newCode.push_back({BLOCK, itr->first, size, {}});
+		}
+		for (; itr != end; ++itr) {
+			newCode.push_back({kind.code, itr->first, itr->second, kind.rRef});
+		}
+	}
+}
+
+// Cells the partial evaluator keeps, the most instructions it runs and the
+// most bytes it prints. Every byte printed becomes a SET_C and a WRITE, so a
+// long output is left for the program to print.
+constexpr auto PREFIX_TAPE_LENGTH = 1 << 16;
+constexpr std::uint64_t PREFIX_STEP_LIMIT = 1 << 20;
+constexpr std::size_t PREFIX_OUTPUT_LIMIT = 1 << 8;
+
+// State of a program partially run at optimization time. `end` is where
+// it stopped, or -1 if it left the tape halfway through an instruction,
+// `checkpoint` the last instruction outside of every loop it got to and
+// `steps` the instructions run before that one.
+template <CellType Cell> struct Prefix {
+	std::vector<Cell> tape = std::vector<Cell>(PREFIX_TAPE_LENGTH);
+	int ptr = PREFIX_TAPE_LENGTH / 2;
+	std::string output;
+	int end = 0, checkpoint = 0;
+	std::uint64_t steps = 0;
+};
+
+// Runs `code` from a blank tape until it needs input, reaches DEBUG or
+// HALT, leaves the tape of the Prefix, has run `limit` instructions or is
+// about to print more than PREFIX_OUTPUT_LIMIT bytes.
+// `topLevel` marks the instructions outside of every loop.
+template <CellType Cell>
+Prefix<Cell> runPrefix(
+	std::span<const Instruction> code, const std::vector<bool>& topLevel,
+	std::uint64_t limit) {
+	Prefix<Cell> s;
+	auto& tape = s.tape;
+	auto& ptr = s.ptr;
+	std::uint64_t steps = 0;
+	auto outside = false;
+
+	// cells off the tape all land in `sink`, what is left in it does not
+	// matter as the run is given up once `outside` is set
+	Cell sink = 0;
+	auto at = [&](int offset) -> Cell& {
+		const auto i = ptr + offset;
+		if (i < 0 || i >= PREFIX_TAPE_LENGTH) {
+			outside = true;
+			sink = 0;
+			return sink;
+		}
+		return tape[i];
+	};
+	// unsigned arithmetic, as 16 bit cells would overflow an int
+	auto product = [&](const Instruction& i) {
+		std::uint32_t t = static_cast<Cell>(i.value);
+		for (const auto& r : i.rRef) { t *= at(r); }
+		return static_cast<Cell>(t);
+	};
+
+	auto pc = 0;
+	for (; pc < static_cast<int>(code.size()); ++pc, ++steps) {
+		if (topLevel[pc]) {
+			s.checkpoint = pc;
+			s.steps = steps;
+		}
+		if (steps >= limit) { break; }
+		const auto& i = code[pc];
+		switch (i.code) {
+			case TAPE_M:
+				ptr += i.value;
+				at(0);
+				break;
+
+			case INCR:
+				at(i.lRef) += product(i);
+				break;
+
+			case SET_C:
+				at(i.lRef) = static_cast<Cell>(i.value);
+				break;
+
+			case LINEAR: {
+				const auto members = code.subspan(pc + 1, i.value);
+				std::vector<Cell> values;
+				for (const auto& m : members) {
+					values.push_back(
+						m.code == SET_C ? static_cast<Cell>(m.value)
+										: product(m));
+				}
+				for (auto k = 0u; k < members.size(); ++k) {
+					auto& cell = at(members[k].lRef);
+					cell = members[k].code == SET_C ? values[k]
+													: cell + values[k];
+				}
+				pc += i.value;
+				break;
+			}
+
+			case SCAN:
+				while (!outside && at(0) != 0) { ptr += i.value; }
+				break;
+
+			case SWEEP: {
+				const auto members = code.subspan(pc + 1, i.value);
+				while (!outside && at(0) != 0) {
+					for (const auto& m : members) {
+						auto& cell = at(m.lRef);
+						cell = m.code == SET_C ? static_cast<Cell>(m.value)
+											   : cell + product(m);
+					}
+					ptr += i.lRef;
+				}
+				pc += i.value;
+				break;
+			}
+
+			case WRITE:
+				if (s.output.size() == PREFIX_OUTPUT_LIMIT) {
+					s.end = pc;
+					return s;
+				}
+				s.output.push_back(static_cast<char>(at(i.lRef)));
+				break;
+
+			case JUMP_C:
+				if (at(0) == 0) { pc += i.value; }
+				break;
+
+			case JUMP_O:
+				if (at(0) != 0) { pc += i.value; }
+				break;
+
+			case NO_OP:
+			case BLOCK:
+				break;
+			case READ:
+			case DEBUG:
+			case HALT:
+				s.end = pc;
+				return s;
+		}
+		if (outside) {
+			s.end = -1;
+			return s;
+		}
+	}
+	s.end = pc;
+	return s;
+}
+
+// Cells a loop may change, relative to the pointer at its start, and if
+// the pointer is back there every time the loop tests its cell
+struct LoopEffect {
+	std::set<int> writes;
+	bool balanced = true;
+};
+
+LoopEffect loopEffect(std::span<const Instruction> loop) {
+	LoopEffect e;
+	std::vector<int> stack;
+	auto shift = 0;
+	for (const auto& i : loop) {
+		switch (i.code) {
+			case TAPE_M:
+				shift += i.value;
+				break;
+			case INCR:
+			case SET_C:
+			case READ:
+				e.writes.insert(shift + i.lRef);
+				break;
+			case JUMP_C:
+				stack.push_back(shift);
+				break;
+			case JUMP_O:
+				e.balanced = e.balanced && stack.back() == shift;
+				stack.pop_back();
+				break;
+			case SCAN:
+			case SWEEP:
+				e.balanced = false;
+				break;
+			case NO_OP:
+			case WRITE:
+			case LINEAR:
+			case BLOCK:
+			case DEBUG:
+			case HALT:
+				break;
+		}
+	}
+	e.balanced = e.balanced && shift == 0;
+	return e;
+}
+
+// What is known about the tape at some point of a program: cells are keyed
+// by their distance to the pointer at the start or at the last move by an
+// unknown amount. A cell without an entry is 0 if `restZero`, else unknown.
+template <CellType Cell> struct KnownCells {
+	std::map<int, std::optional<Cell>> cells;
+	bool restZero = true;
+
+	std::optional<Cell> at(int c) const {
+		if (auto itr = cells.find(c); itr != cells.end()) {
+			return itr->second;
+		}
+		return restZero ? std::optional<Cell>(0) : std::nullopt;
+	}
+	void forget() {
+		cells.clear();
+		restZero = false;
+	}
+};
+
+// Loops a thread is given at least, fewer are not worth starting it
+constexpr auto LOOPS_PER_THREAD = 16u;
+
+template <CellType Cell> class Program {
 	std::optional<std::string> err;
 	std::vector<Instruction> program;
-	std::vector<int> srcToProgram;
+	// Source offset each instruction of the parsed program starts at, a run
+	// of commands merged into one instruction has one entry
+	std::vector<std::size_t> sourceMap;
+	LinearCache linearCache;
+	unsigned jobs = 0;
+	// What a pass writes the next version of the program to, moving the
+	// instructions over. It is swapped with `program` once the pass is done,
+	// so that the two buffers keep their capacity from one pass to the next.
+	std::vector<Instruction> next;
+
+	std::vector<Instruction>& beginRewrite() {
+		next.clear();
+		next.reserve(program.size());
+		return next;
+	}
+
+	void endRewrite() {
+		matchJumps(next);
+		program.swap(next);
+	}
 
 	void aggregate() {
 		if (program.size() < 2) { return; }
@@ -505,7 +1113,7 @@ class Program {
 		auto& a = program[program.size() - 2];
 		if (a.code == b.code && a.code == Inst_Codes::INCR &&
 			a.lRef == b.lRef && a.rRef.empty() && b.rRef.empty()) {
-			a.value += b.value;
+			a.value = wrap<Cell>(a.value + b.value);
 			program.pop_back();
 			return;
 		}
@@ -516,33 +1124,45 @@ class Program {
 		}
 	}
 
-	int getProgramToCode(int pos) {
-		return static_cast<int>(
-			std::ranges::lower_bound(srcToProgram, pos) - srcToProgram.begin());
-	}
+	std::size_t getProgramToCode(int pos) { return sourceMap[pos]; }
 
 	void parse(const Args& args) {
 		if (args.input.empty()) {
 			err = "fatal error: no input files";
 			return;
 		}
-		std::ifstream input(args.input);
-		if (!input.is_open()) {
+		SourceFile source(args.input);
+		if (!source.isOpen()) {
 			err = "cannot read file: '" + args.input.string() + "'";
 			return;
 		}
+		const auto text = source.text();
+		CommandScanner commands(text, args.isa);
 		std::vector<int> stack;
 
 #ifdef LOG_INST
 		std::ofstream original("/tmp/orig.bfas");
 #endif
 
-		while (true) {
-			auto ch = '\0';
+		for (auto pos = commands.next(0);; pos = commands.next(pos)) {
 			Instruction inst;
-
-			if (input.get(ch)) {
-				inst = getInstruction(ch);
+			auto end = pos + 1;
+
+			if (pos < text.size()) {
+				inst = getInstruction(text[pos]);
+				// a run of the same +-<> is taken as a whole
+				if (inst.code == INCR || inst.code == TAPE_M) {
+					end = std::find_if(
+							  text.begin() + end, text.end(),
+							  [&](char ch) { return ch != text[pos]; }) -
+						  text.begin();
+					const auto n = static_cast<unsigned>(end - pos);
+					inst.value = static_cast<int>(
+						static_cast<unsigned>(inst.value) * n);
+					if (inst.code == INCR) {
+						inst.value = wrap<Cell>(inst.value);
+					}
+				}
 			} else {
 				inst = {
 					.code = Inst_Codes::HALT,
@@ -551,19 +1171,20 @@ class Program {
 					.rRef = {}};
 			}
 
-			if (inst.code != NO_OP) {
-				program.push_back(inst);
 #ifdef LOG_INST
-				original << inst << "\n";
-#endif
-				aggregate();
+			for (auto k = pos; k < end; ++k) {
+				original << (k < text.size() ? getInstruction(text[k]) : inst)
+						 << "\n";
 			}
-
-			srcToProgram.push_back(static_cast<int>(program.size() - 1));
+#endif
+			const auto size = program.size();
+			program.push_back(inst);
+			aggregate();
+			if (program.size() > size) { sourceMap.push_back(pos); }
+			pos = end;
 
 			if (inst.code == JUMP_C) {
-				int pos = static_cast<int>(program.size() - 1);
-				stack.push_back(pos);
+				stack.push_back(static_cast<int>(program.size() - 1));
 			} else if (inst.code == JUMP_O) {
 				int closing = static_cast<int>(program.size() - 1);
 				if (stack.empty()) {
@@ -586,7 +1207,8 @@ class Program {
 	}
 
 	void printLoops(
-		const std::string& title, std::vector<std::pair<int, int>>& loops) {
+		const std::string& title,
+		std::vector<std::pair<std::uint64_t, int>>& loops) {
 		std::ranges::sort(loops, std::greater<>());
 
 		const auto H_BAR = 80u;
@@ -614,39 +1236,58 @@ class Program {
 		}
 	}
 
-	void optimizeInnerLoops(
+	// Offers every innermost loop to `optimizer`, true if it rewrote any. The
+	// loops are looked at in rounds on up to `jobs` threads, and the rewrites
+	// of a round are spliced in program order, so the result does not depend
+	// on which thread got which loop. A loop becomes innermost once its inner
+	// loops are rewritten, so each round after the first looks at the loops
+	// right around the rewrites of the one before.
+	bool optimizeInnerLoops(
 		const std::string& name, const std::function<bool(
 									 const CodeInfo&, std::span<Instruction>,
 									 std::vector<Instruction>&)>& optimizer) {
-		std::vector<Instruction> p, newCode;
-		std::vector<int> stack;
+		// loops whose JUMP_C is marked are looked at in the next round
+		std::vector<bool> pending(program.size(), true);
+		int count = 0;
 
 #ifdef LOG_INST
-		int count = 0;
 		std::ofstream before(std::string("/tmp/before-") + name + ".bfas");
 		std::ofstream after(std::string("/tmp/after-") + name + ".bfas");
 #endif
 
-		for (auto& inst : program) {
-			p.push_back(inst);
-			if (inst.code == JUMP_C) {
-				stack.push_back(static_cast<int>(p.size() - 1));
+		while (true) {
+			std::vector<std::pair<int, int>> loops;
+			auto opening = -1;
+			for (auto i = 0; i < static_cast<int>(program.size()); ++i) {
+				if (program[i].code == JUMP_C) { opening = i; }
+				if (program[i].code != JUMP_O) { continue; }
+				if (opening >= 0 && pending[opening]) {
+					loops.emplace_back(opening, i + 1);
+				}
+				opening = -1;
 			}
-			if (inst.code != JUMP_O) { continue; }
 
-			// compute the new jump deltas
-			int closing = static_cast<int>(p.size() - 1);
-			int opening = stack.back();
-			p[closing].value = opening - closing;
-			p[opening].value = closing - opening;
-			stack.pop_back();
-
-			auto begin = p.end() + p.back().value - 1;
-			auto end = p.end();
-			std::span<Instruction> code(begin, end);
-			auto info = loopInfo(code);
-			if (isInnerMostLoop(info) && optimizer(info, code, newCode)) {
+			std::vector<std::vector<Instruction>> rewrites(loops.size());
+			std::vector<char> rewritten(loops.size());
+			parallelFor(loops.size(), jobs, LOOPS_PER_THREAD, [&](auto k) {
+				std::span<Instruction> code(
+					program.begin() + loops[k].first,
+					program.begin() + loops[k].second);
+				auto info = loopInfo(code);
+				rewritten[k] = isInnerMostLoop(info) &&
+							   optimizer(info, code, rewrites[k]);
+			});
+
+			std::vector<std::size_t> starts;
+			auto& p = beginRewrite();
+			auto from = program.begin();
+			for (auto k = 0u; k < loops.size(); ++k) {
+				if (!rewritten[k]) { continue; }
+				auto begin = program.begin() + loops[k].first;
+				auto end = program.begin() + loops[k].second;
 #ifdef LOG_INST
+				std::span<Instruction> code(begin, end);
+				auto& newCode = rewrites[k];
 				for (auto& e : code) { print(before, "%", e); }
 				print(before, "================%================", count);
 				for (auto& e : code) { print(before, "%", e); }
@@ -655,50 +1296,415 @@ class Program {
 				print(after, "================%================", count);
 				for (auto& e : newCode) { print(after, "%", e); }
 				print(after, "================%================", count);
-				count++;
 #endif
-				p.erase(begin, end);
-				p.insert(p.end(), newCode.begin(), newCode.end());
-				newCode.clear();
+				count++;
+				p.insert(
+					p.end(), std::make_move_iterator(from),
+					std::make_move_iterator(begin));
+				starts.push_back(p.size());
+				p.insert(
+					p.end(), std::make_move_iterator(rewrites[k].begin()),
+					std::make_move_iterator(rewrites[k].end()));
+				from = end;
+			}
+			if (starts.empty()) { break; }
+			p.insert(
+				p.end(), std::make_move_iterator(from),
+				std::make_move_iterator(program.end()));
+			endRewrite();
+
+			pending.assign(program.size(), false);
+			std::vector<std::size_t> stack;
+			for (auto i = 0u, s = 0u; i < program.size(); ++i) {
+				if (s < starts.size() && starts[s] == i) {
+					if (!stack.empty()) { pending[stack.back()] = true; }
+					s++;
+				}
+				if (program[i].code == JUMP_C) { stack.push_back(i); }
+				if (program[i].code == JUMP_O) { stack.pop_back(); }
 			}
 		}
 
-		program = p;
-
 #ifdef LOG_INST
 		print(std::cerr, "Optimizations by %: %", name, count);
 		std::ofstream optimized("/tmp/actual.bfas");
 		for (const auto& i : program) { optimized << i << "\n"; }
 #endif
+		return count > 0;
 	}
-	void optimizeSimpleLoops() {
-		optimizeInnerLoops(__FUNCTION__, [](auto& info, auto, auto& newCode) {
-			if (!isSimpleLoop(info)) { return false; }
-			auto delta = info.delta;
-			int change = -delta[0];
-			delta.erase(0);
-			newCode.reserve(delta.size());
-			for (auto& e : delta) {
-				newCode.push_back({INCR, e.first, change * e.second, {0}});
-			}
-			newCode.push_back({SET_C, 0, 0, {}});
-			return true;
-		});
+	bool optimizeSimpleLoops() {
+		return optimizeInnerLoops(
+			__FUNCTION__, [](auto& info, auto, auto& newCode) {
+				if (!isSimpleLoop(info)) { return false; }
+				auto delta = info.delta;
+				int change = -delta[0];
+				delta.erase(0);
+				newCode.reserve(delta.size());
+				for (auto& e : delta) {
+					newCode.push_back({INCR, e.first, change * e.second, {0}});
+				}
+				newCode.push_back({SET_C, 0, 0, {}});
+				return true;
+			});
 	}
 
-	void optimizeScans() {
-		optimizeInnerLoops(__FUNCTION__, [](auto& info, auto, auto& newCode) {
-			if (!isScanLoop(info)) { return false; }
-			int scanJump = info.shift;
-			newCode.push_back({SCAN, 0, scanJump, {}});
-			return true;
-		});
+	bool optimizeScans() {
+		return optimizeInnerLoops(
+			__FUNCTION__, [](auto& info, auto, auto& newCode) {
+				if (!isScanLoop(info)) { return false; }
+				int scanJump = info.shift;
+				newCode.push_back({SCAN, 0, scanJump, {}});
+				return true;
+			});
 	}
 
-	void linearizeLoops() {
-		optimizeInnerLoops(__FUNCTION__, [&](auto&, auto code, auto& newCode) {
-			return linearTest(code, newCode);
-		});
+	bool optimizeSweeps() {
+		return optimizeInnerLoops(
+			__FUNCTION__, [](auto& info, auto code, auto& newCode) {
+				return sweepTest<Cell>(info, code, newCode);
+			});
+	}
+
+	bool linearizeLoops(Solver solver) {
+		return optimizeInnerLoops(
+			__FUNCTION__, [&](auto&, auto code, auto& newCode) {
+				return linearCache.linearize(code, newCode, solver);
+			});
+	}
+
+	// A loop whose inner loops all became straight line code is an innermost
+	// loop itself, so the loop passes take turns until none of them changes
+	// the program. Each pass already sees the loops it rewrote itself, so
+	// after one changed something only the others need to run again.
+	void optimizeLoops(const Args& args) {
+		std::vector<std::function<bool()>> passes;
+		if (args.optimizeSimpleLoops) {
+			passes.emplace_back([&] { return optimizeSimpleLoops(); });
+		}
+		if (args.optimizeScans) {
+			passes.emplace_back([&] { return optimizeScans(); });
+		}
+		if (args.optimizeSweeps) {
+			passes.emplace_back([&] { return optimizeSweeps(); });
+		}
+		if (args.linearizeLoops) {
+			passes.emplace_back([&] { return linearizeLoops(args.solver); });
+		}
+		for (auto i = 0u, idle = 0u; idle < passes.size(); ++i) {
+			idle = passes[i % passes.size()]() ? 1 : idle + 1;
+		}
+	}
+
+	// Runs the program up to its first READ, or as long as its output stays
+	// short, at optimization time and replaces what ran with the bytes it
+	// wrote and the tape it left, as SET_C of the cells that are not 0 and a
+	// TAPE_M. The program can only resume outside of every loop, so a run
+	// stopped inside one is repeated up to the last such point.
+	void evaluatePrefix() {
+		std::vector<bool> topLevel(program.size());
+		auto depth = 0;
+		for (auto i = 0u; i < program.size(); ++i) {
+			topLevel[i] = depth == 0;
+			if (program[i].code == JUMP_C) { depth++; }
+			if (program[i].code == JUMP_O) { depth--; }
+		}
+
+		auto s = runPrefix<Cell>(program, topLevel, PREFIX_STEP_LIMIT);
+		if (s.end != s.checkpoint) {
+			s = runPrefix<Cell>(program, topLevel, s.steps);
+		}
+		if (s.checkpoint == 0) { return; }
+
+		constexpr auto START = PREFIX_TAPE_LENGTH / 2;
+		auto& p = beginRewrite();
+		for (const auto& ch : s.output) {
+			p.push_back({SET_C, 0, wrap<Cell>(static_cast<Cell>(ch)), {}});
+			p.push_back({WRITE, 0, 0, {}});
+		}
+		for (auto i = 0; i < PREFIX_TAPE_LENGTH; ++i) {
+			if (s.tape[i] != 0 || (i == START && !s.output.empty())) {
+				p.push_back({SET_C, i - START, wrap<Cell>(s.tape[i]), {}});
+			}
+		}
+		if (s.ptr != START) { p.push_back({TAPE_M, 0, s.ptr - START, {}}); }
+		p.insert(
+			p.end(), std::make_move_iterator(program.begin() + s.checkpoint),
+			std::make_move_iterator(program.end()));
+
+#ifdef LOG_INST
+		print(std::cerr, "Instructions run by %: %", __FUNCTION__, s.steps);
+#endif
+		endRewrite();
+	}
+
+	// Follows the cells known to hold a constant through the program. Loops
+	// testing a cell known to be 0 are dropped, INCRs of known cells become
+	// constants and SET_C/INCR leaving a cell as it is are dropped. A loop
+	// forgets the cells it may change, or everything if it moves the
+	// pointer, and leaves its cell at 0.
+	void propagateValues() {
+		auto& p = beginRewrite();
+		KnownCells<Cell> known;
+		std::vector<KnownCells<Cell>> entries;
+		auto offset = 0;
+
+		for (auto i = 0u; i < program.size(); ++i) {
+			auto& inst = program[i];
+			switch (inst.code) {
+				case TAPE_M:
+					offset += inst.value;
+					break;
+
+				case INCR: {
+					const auto c = offset + inst.lRef;
+					auto t = static_cast<std::uint32_t>(inst.value);
+					auto constant = true;
+					for (const auto& r : inst.rRef) {
+						if (auto v = known.at(offset + r)) {
+							t *= *v;
+						} else {
+							constant = false;
+						}
+					}
+					// a known factor of 0 leaves the cell as it is
+					if (static_cast<Cell>(t) == 0) { continue; }
+					if (!constant) {
+						known.cells[c] = std::nullopt;
+						break;
+					}
+					inst.rRef.clear();
+					inst.value = wrap<Cell>(static_cast<Cell>(t));
+					if (auto v = known.at(c)) {
+						inst.code = SET_C;
+						inst.value = wrap<Cell>(static_cast<Cell>(*v + t));
+						known.cells[c] = static_cast<Cell>(*v + t);
+					} else {
+						known.cells[c] = std::nullopt;
+					}
+					break;
+				}
+
+				case SET_C: {
+					const auto c = offset + inst.lRef;
+					const auto v = static_cast<Cell>(inst.value);
+					if (known.at(c) == v) { continue; }
+					known.cells[c] = v;
+					break;
+				}
+
+				case READ:
+					known.cells[offset + inst.lRef] = std::nullopt;
+					break;
+
+				case LINEAR: {
+					const auto members = inst.value;
+					for (auto k = 1; k <= members; ++k) {
+						known.cells[offset + program[i + k].lRef] =
+							std::nullopt;
+					}
+					p.insert(
+						p.end(), std::make_move_iterator(program.begin() + i),
+						std::make_move_iterator(
+							program.begin() + i + members + 1));
+					i += members;
+					continue;
+				}
+
+				case JUMP_C: {
+					if (known.at(offset) == 0) {
+						i += inst.value;
+						continue;
+					}
+					const auto e = loopEffect(
+						std::span(program).subspan(i, inst.value + 1));
+					if (e.balanced) {
+						for (const auto& w : e.writes) {
+							known.cells[offset + w] = std::nullopt;
+						}
+					} else {
+						known.forget();
+					}
+					entries.push_back(known);
+					break;
+				}
+
+				case JUMP_O:
+					known = std::move(entries.back());
+					entries.pop_back();
+					known.cells[offset] = 0;
+					break;
+
+				case SCAN:
+					known.forget();
+					known.cells[offset] = 0;
+					break;
+
+				case SWEEP: {
+					const auto members = inst.value;
+					if (known.at(offset) != 0) {
+						p.insert(
+							p.end(),
+							std::make_move_iterator(program.begin() + i),
+							std::make_move_iterator(
+								program.begin() + i + members + 1));
+						known.forget();
+						known.cells[offset] = 0;
+					}
+					i += members;
+					continue;
+				}
+
+				case WRITE:
+				case NO_OP:
+				case BLOCK:
+				case DEBUG:
+				case HALT:
+					break;
+			}
+			p.push_back(std::move(inst));
+		}
+
+		endRewrite();
+	}
+
+	// Drops SET_C and INCR of cells set again before anything reads them, or
+	// before HALT. Only straight line code is looked at, every loop edge,
+	// SCAN, LINEAR and DEBUG may read any cell.
+	void eliminateDeadStores() {
+		std::vector<bool> keep(program.size(), true), member(program.size());
+		for (auto i = 0u; i < program.size(); ++i) {
+			if (program[i].code != LINEAR && program[i].code != SWEEP) {
+				continue;
+			}
+			for (auto k = 0; k <= program[i].value; ++k) { member[i + k] = true; }
+		}
+
+		std::set<int> dead;
+		auto allDead = false;
+		auto offset = 0;
+		for (auto i = static_cast<int>(program.size()) - 1; i >= 0; --i) {
+			const auto& inst = program[i];
+			const auto c = offset + inst.lRef;
+			if (member[i]) {
+				dead.clear();
+				allDead = false;
+				continue;
+			}
+			switch (inst.code) {
+				case TAPE_M:
+					offset -= inst.value;
+					break;
+				case SET_C:
+				case INCR:
+					if (allDead || dead.contains(c)) {
+						keep[i] = false;
+						break;
+					}
+					if (inst.code == SET_C) {
+						dead.insert(c);
+					} else {
+						for (const auto& r : inst.rRef) { dead.erase(offset + r); }
+					}
+					break;
+				case WRITE:
+				case READ:
+					if (allDead) {
+						dead.clear();
+						allDead = false;
+					}
+					dead.erase(c);
+					break;
+				case HALT:
+					allDead = true;
+					break;
+				case NO_OP:
+				case JUMP_C:
+				case JUMP_O:
+				case SCAN:
+				case SWEEP:
+				case LINEAR:
+				case BLOCK:
+				case DEBUG:
+					dead.clear();
+					allDead = false;
+					break;
+			}
+		}
+
+		auto& p = beginRewrite();
+		for (auto i = 0u; i < program.size(); ++i) {
+			if (keep[i]) { p.push_back(std::move(program[i])); }
+		}
+		endRewrite();
+	}
+
+	// Carries the pointer movements of each straight line block as an offset
+	// folded into the references of the instructions after them. The pointer
+	// only really moves before what needs it to point at the right cell:
+	// the tests of a loop, SCAN and DEBUG. Whatever is left at HALT is
+	// dropped.
+	void eliminatePointerMoves() {
+		auto& p = beginRewrite();
+		auto offset = 0;
+
+		for (auto& inst : program) {
+			switch (inst.code) {
+				case TAPE_M:
+					offset += inst.value;
+					continue;
+				case INCR:
+				case SET_C:
+				case WRITE:
+				case READ:
+				case BLOCK:
+					inst.lRef += offset;
+					for (auto& r : inst.rRef) { r += offset; }
+					break;
+				case JUMP_C:
+				case JUMP_O:
+				case SCAN:
+				case SWEEP:
+				case DEBUG:
+					if (offset != 0) { p.push_back({TAPE_M, 0, offset, {}}); }
+					offset = 0;
+					break;
+				case NO_OP:
+				case LINEAR:
+				case HALT:
+					break;
+			}
+			p.push_back(std::move(inst));
+		}
+
+		endRewrite();
+	}
+
+	// Groups runs of INCR and SET_C updating nearby cells the same way into
+	// BLOCKs. Members of a LINEAR are left alone, they all read the tape
+	// from before it, and so are those of a SWEEP.
+	void fuseBlocks() {
+		auto& p = beginRewrite();
+
+		for (auto i = 0u; i < program.size();) {
+			auto& inst = program[i];
+			auto end = i + 1;
+			if (inst.code == LINEAR || inst.code == SWEEP) {
+				end += inst.value;
+				p.insert(
+					p.end(), std::make_move_iterator(program.begin() + i),
+					std::make_move_iterator(program.begin() + end));
+			} else if (sameUpdate(inst, inst)) {
+				while (end < program.size() && sameUpdate(inst, program[end])) {
+					++end;
+				}
+				fuseRun(std::span(program).subspan(i, end - i), p);
+			} else {
+				p.push_back(std::move(inst));
+			}
+			i = end;
+		}
+
+		endRewrite();
 	}
 
    public:
@@ -707,9 +1713,22 @@ class Program {
 	Program(const Args& args) {
 		parse(args);
 		if (isOK()) {
-			if (args.optimizeSimpleLoops) { optimizeSimpleLoops(); }
-			if (args.optimizeScans) { optimizeScans(); }
-			if (args.linearizeLoops) { linearizeLoops(); }
+			jobs = args.jobs;
+			if (!args.linearCache.empty()) {
+				linearCache.load(args.linearCache);
+			}
+			optimizeLoops(args);
+			if (!args.linearCache.empty()) {
+				linearCache.save(args.linearCache);
+			}
+			if (args.evaluatePrefix) { evaluatePrefix(); }
+			if (args.eliminateDeadCode) {
+				propagateValues();
+				eliminateDeadStores();
+			}
+			if (args.eliminatePointerMoves) { eliminatePointerMoves(); }
+			if (args.fuseBlocks) { fuseBlocks(); }
+			next = {};
 		}
 #ifdef LOG_INST
 		std::ofstream optimized("/tmp/actual.bfas");
@@ -719,7 +1738,7 @@ class Program {
 	auto error() { return err.value(); }
 	auto& instructions() { return program; }
 
-	void printProfileInfo(std::span<int> runCounts) {
+	void printProfileInfo(std::span<const std::uint64_t> runCounts) {
 		constexpr auto WIDTH = 5;
 		if (runCounts.size() != program.size()) {
 			throw std::runtime_error(
@@ -730,7 +1749,7 @@ class Program {
 			std::cout << std::setw(WIDTH) << i << " : " << program[i] << " : "
 					  << runCounts[i] << "\n";
 		}
-		std::vector<std::pair<int, int>> simple, notSimple, scan;
+		std::vector<std::pair<std::uint64_t, int>> simple, notSimple, scan;
 		for (auto i = 0u; i < program.size(); ++i) {
 			const auto& instr = program[i];
 			if (instr.code != JUMP_C) { continue; }
@@ -27,6 +27,17 @@ verify() {
 	fi
 }
 
+echo "Checking compile time"
+# bottles.b prints all of its output without reading any input, which the
+# partial evaluator must not unroll into the compiled program
+if ! timeout --verbose 10 ./build/bfc ./benches/bottles.b; then
+	echo "${RED}FAILED: compile time of ./benches/bottles.b${NORMAL}"
+	exit 1
+fi
+rm ./a.out
+echo "${GREEN}PASSED: compile time of ./benches/bottles.b${NORMAL}"
+
+echo
 echo "Running Test for compiler"
 for file in ./benches/*.b; do
 	./build/bfc ${file}
@@ -42,3 +53,18 @@ for file in ./benches/*.b; do
 	verify "${file}"
 	rm ./run.out
 done
+
+echo
+echo "Checking output is kept when the pointer runs off the tape"
+# echoes its input and then walks left forever, ending on the low guard
+printf ',.+[<+]' >./oob.b
+./build/bfc ./oob.b
+for run in ./a.out "./build/bfi ./oob.b"; do
+	printf 'A' | timeout --verbose 20 ${run} >./run.out 2>/dev/null
+	if [ $? -ne 1 ] || [ "$(cat ./run.out)" != "A" ]; then
+		echo "${RED}FAILED: out of bounds exit of ${run}${NORMAL}"
+		exit 1
+	fi
+	echo "${GREEN}PASSED: out of bounds exit of ${run}${NORMAL}"
+done
+rm ./oob.b ./a.out ./run.out
@@ -0,0 +1,382 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <span>
+
+#include "parser.hpp"
+#include "util.hpp"
+
+// SCAN moves the pointer by `jump` until it lands on a zero cell. Every
+// kernel returns the distance travelled, the tape is assumed to hold a
+// zero in that direction.
+
+template <CellType Cell>
+int slowScan(std::span<const Cell> tape, int BASE, int jump) {
+	for (auto i = 0;; i += jump) {
+		if (tape[i + BASE] == 0) { return i; }
+	}
+	return -1;
+}
+
+// Vector instruction sets a scan can run on. `zeros` loads BYTES bytes from
+// a BYTES aligned address and returns a mask with bit k set iff the kth cell
+// is zero, `partialZeros` does the same when only the `valid` lanes are on
+// the tape.
+// Sets with gathers also check GATHER cells at once, `gatherZeros` does the
+// same as `zeros` for the cells at the byte offsets `offsets` from p.
+// Gathers load 32 bits per lane, narrower cells drop their neighbours' bits.
+namespace isa {
+	template <CellType Cell>
+	constexpr int CELL_MASK = std::numeric_limits<Cell>::max();
+
+	struct Avx512 {
+		static constexpr auto BYTES = 64;
+		static constexpr auto GATHER = 16;
+
+		template <CellType Cell>
+		[[gnu::target("avx512bw")]] static std::uint64_t gatherZeros(
+			const Cell* p, const int* offsets) {
+			const auto v = _mm512_mask_i32gather_epi32(
+				_mm512_setzero_si512(), ~0, _mm512_loadu_si512(offsets), p, 1);
+			return _mm512_testn_epi32_mask(
+				v, _mm512_set1_epi32(CELL_MASK<Cell>));
+		}
+
+		template <CellType Cell>
+		[[gnu::target("avx512bw")]] static std::uint64_t zeros(
+			const Cell* p) {
+			const auto v = _mm512_load_si512(p);
+			const auto zero = _mm512_setzero_si512();
+			if constexpr (sizeof(Cell) == 1) {
+				return _mm512_cmpeq_epi8_mask(v, zero);
+			} else if constexpr (sizeof(Cell) == 2) {
+				return _mm512_cmpeq_epi16_mask(v, zero);
+			} else {
+				return _mm512_cmpeq_epi32_mask(v, zero);
+			}
+		}
+
+		// masked loads never touch the lanes left out
+		template <CellType Cell>
+		[[gnu::target("avx512bw")]] static std::uint64_t partialZeros(
+			const Cell* p, std::uint64_t valid) {
+			const auto zero = _mm512_setzero_si512();
+			if constexpr (sizeof(Cell) == 1) {
+				const auto v = _mm512_maskz_loadu_epi8(valid, p);
+				return _mm512_mask_cmpeq_epi8_mask(valid, v, zero);
+			} else if constexpr (sizeof(Cell) == 2) {
+				const auto v = _mm512_maskz_loadu_epi16(valid, p);
+				return _mm512_mask_cmpeq_epi16_mask(valid, v, zero);
+			} else {
+				const auto v = _mm512_maskz_loadu_epi32(valid, p);
+				return _mm512_mask_cmpeq_epi32_mask(valid, v, zero);
+			}
+		}
+	};
+
+	struct Avx2 {
+		static constexpr auto BYTES = 32;
+		static constexpr auto GATHER = 8;
+
+		template <CellType Cell>
+		[[gnu::target("avx2")]] static std::uint64_t gatherZeros(
+			const Cell* p, const int* offsets) {
+			const auto v = _mm256_mask_i32gather_epi32(
+				_mm256_setzero_si256(), reinterpret_cast<const int*>(p),
+				_mm256_loadu_si256(reinterpret_cast<const __m256i*>(offsets)),
+				_mm256_set1_epi32(-1), 1);
+			const auto cells =
+				_mm256_and_si256(v, _mm256_set1_epi32(CELL_MASK<Cell>));
+			const auto eq = _mm256_cmpeq_epi32(cells, _mm256_setzero_si256());
+			return static_cast<std::uint32_t>(
+				_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+		}
+
+		template <CellType Cell>
+		[[gnu::target("avx2")]] static std::uint64_t zeros(const Cell* p) {
+			const auto v = _mm256_load_si256(reinterpret_cast<const __m256i*>(p));
+			const auto zero = _mm256_setzero_si256();
+			if constexpr (sizeof(Cell) == 1) {
+				return static_cast<std::uint32_t>(
+					_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+			} else if constexpr (sizeof(Cell) == 2) {
+				// packing works within 128 bit halves, so the lanes of the
+				// upper half land in bits 16-23
+				const auto eq = _mm256_cmpeq_epi16(v, zero);
+				const auto m = static_cast<std::uint32_t>(
+					_mm256_movemask_epi8(_mm256_packs_epi16(eq, eq)));
+				return (m & 0xFF) | ((m >> 8) & 0xFF00);
+			} else {
+				return static_cast<std::uint32_t>(_mm256_movemask_ps(
+					_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))));
+			}
+		}
+
+		// an aligned vector never straddles a page, the lanes off the tape
+		// can be read as long as one lane is on it
+		template <CellType Cell>
+		[[gnu::target("avx2")]] static std::uint64_t partialZeros(
+			const Cell* p, std::uint64_t valid) {
+			return zeros(p) & valid;
+		}
+	};
+
+	struct Sse2 {
+		static constexpr auto BYTES = 16;
+		static constexpr auto GATHER = 0;
+
+		template <CellType Cell>
+		[[gnu::target("sse2")]] static std::uint64_t zeros(const Cell* p) {
+			const auto v = _mm_load_si128(reinterpret_cast<const __m128i*>(p));
+			const auto zero = _mm_setzero_si128();
+			if constexpr (sizeof(Cell) == 1) {
+				return static_cast<std::uint32_t>(
+					_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+			} else if constexpr (sizeof(Cell) == 2) {
+				const auto eq = _mm_cmpeq_epi16(v, zero);
+				return static_cast<std::uint32_t>(
+						   _mm_movemask_epi8(_mm_packs_epi16(eq, eq))) &
+					   0xFF;
+			} else {
+				return static_cast<std::uint32_t>(_mm_movemask_ps(
+					_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))));
+			}
+		}
+
+		// an aligned vector never straddles a page, the lanes off the tape
+		// can be read as long as one lane is on it
+		template <CellType Cell>
+		[[gnu::target("sse2")]] static std::uint64_t partialZeros(
+			const Cell* p, std::uint64_t valid) {
+			return zeros(p) & valid;
+		}
+	};
+}  // namespace isa
+
+// Cells checked per step by `Isa`, one mask bit each
+template <typename Isa, CellType Cell>
+constexpr int LANES = Isa::BYTES / static_cast<int>(sizeof(Cell));
+
+// Lanes of the vector starting at cell `start` that are on a tape of `size`
+// cells
+template <int N> std::uint64_t lanesOnTape(int start, int size) {
+	constexpr auto ALL = N == 64 ? ~0ULL : (1ULL << N) - 1;
+	auto valid = ALL;
+	if (start < 0) { valid = -start >= N ? 0 : (valid << -start) & ALL; }
+	if (start + N > size) {
+		const auto over = start + N - size;
+		valid = over >= N ? 0 : valid & (ALL >> over);
+	}
+	return valid;
+}
+
+// Vectors are read from aligned addresses so no load splits a cache line.
+// The vector holding BASE has the cells the scan has not reached masked
+// off, vectors only partly on the tape read just the lanes on it.
+template <typename Isa, CellType Cell, bool isPowerOf2, bool isJumpNegative>
+int fastScan(std::span<const Cell> tape, int BASE, int jump) {
+	constexpr auto N = LANES<Isa, Cell>;
+	constexpr auto ALL = N == 64 ? ~0ULL : (1ULL << N) - 1;
+	constexpr auto STEP = isJumpNegative ? -N : N;
+	const auto size = static_cast<int>(tape.size());
+	const auto* cells = tape.data();
+
+	// BASE is lane `head` of the first vector, which starts at cell `start`
+	const auto head = static_cast<int>(
+		reinterpret_cast<std::uintptr_t>(cells + BASE) % Isa::BYTES /
+		sizeof(Cell));
+	auto start = BASE - head;
+
+	// generate a mask marking elements visited by jump
+	std::uint64_t mask = 0;
+	for (auto k = head % jump; k < N; k += jump) { mask = mask | 1ULL << k; }
+	int shift = 0;
+
+	if constexpr (!isPowerOf2) {
+		// only used when powerOf2 is false;
+		// how much the mask shifts
+		shift = jump - N % jump;
+	}
+
+	const auto rotate = [&] {
+		if constexpr (!isPowerOf2) {
+			if constexpr (isJumpNegative) {
+				mask = ((mask >> shift) | (mask << (jump - shift))) & ALL;
+			} else {
+				mask = ((mask << shift) | (mask >> (jump - shift))) & ALL;
+			}
+		}
+	};
+	// eq has its ith bit set if ith element == 0, find the first/last one
+	const auto distance = [&](std::uint64_t eq) {
+		if constexpr (isJumpNegative) {
+			return BASE - (start + 63 - std::countl_zero(eq));
+		}
+		return start + std::countr_zero(eq) - BASE;
+	};
+	const auto edgeZeros = [&](std::uint64_t lanes) -> std::uint64_t {
+		const auto valid = lanesOnTape<N>(start, size) & lanes;
+		return valid == 0 ? 0 : Isa::partialZeros(cells + start, valid);
+	};
+
+	const auto first =
+		isJumpNegative ? ALL >> (N - 1 - head) : (ALL << head) & ALL;
+	if (const auto eq = edgeZeros(mask & first); eq != 0) {
+		return distance(eq);
+	}
+
+	// vectors after the first one that are wholly on the tape, checked two
+	// at a time so the bound costs no extra branch per vector
+	const auto whole = isJumpNegative ? start / N : (size - start) / N - 1;
+	const auto* p = cells + start;
+	for (const auto* end = p + whole / 2 * 2 * STEP; p != end;) {
+		rotate();
+		const auto a = Isa::zeros(p + STEP) & mask;
+		rotate();
+		const auto b = Isa::zeros(p + 2 * STEP) & mask;
+		p += 2 * STEP;
+		if ((a | b) != 0) {
+			start = static_cast<int>(p - cells);
+			if (a == 0) { return distance(b); }
+			start -= STEP;
+			return distance(a);
+		}
+	}
+	start = static_cast<int>(p - cells);
+	if (whole % 2 != 0) {
+		rotate();
+		start += STEP;
+		const auto eq = Isa::zeros(cells + start) & mask;
+		if (eq != 0) { return distance(eq); }
+	}
+
+	rotate();
+	start += STEP;
+	if (const auto eq = edgeZeros(mask); eq != 0) { return distance(eq); }
+
+	// no zero on the tape, the scalar scan runs off it like any other
+	// pointer movement would
+	if constexpr (isJumpNegative) { return -slowScan(tape, BASE, -jump); }
+	return slowScan(tape, BASE, jump);
+}
+
+// Scan for jumps too large for a vector to hold a full period. Lane k of a
+// gather checks the kth cell visited, so the lanes read in visiting order
+// whatever the sign of the jump. Gathers that would reach past the tape are
+// left to slowScan.
+template <typename Isa, CellType Cell>
+int stridedScan(std::span<const Cell> tape, int BASE, int jump) {
+	constexpr auto N = Isa::GATHER;
+	// cells covered by the 32 bit load of a lane
+	constexpr auto WIDTH = static_cast<int>(4 / sizeof(Cell));
+	std::array<int, N> offsets{};
+	for (auto k = 0; k < N; ++k) {
+		offsets[k] = k * jump * static_cast<int>(sizeof(Cell));
+	}
+	const auto reach = (N - 1) * jump;
+	const auto low = std::min(0, reach);
+	const auto high = std::max(0, reach) + WIDTH;
+	const auto size = static_cast<int>(tape.size());
+
+	auto i = 0;
+	for (; BASE + i + low >= 0 && BASE + i + high <= size; i += N * jump) {
+		const auto eq = Isa::gatherZeros(&tape[BASE + i], offsets.data());
+		if (eq != 0) { return i + std::countr_zero(eq) * jump; }
+	}
+	return i + slowScan(tape, BASE + i, jump);
+}
+
+// Jumps this large visit too few cells per vector to be worth it
+constexpr auto LARGE_JUMP = 16;
+
+// Whether the `Isa` kernel beats slowScan for `jump`, going by vec_test.
+// A vector has to check at least two visited cells, four when the mask
+// rotates over cells wider than a byte, slowScan being quicker per cell on
+// those. Gathers of wide cells stop paying once a jump reaches 64. slowScan
+// of 8-bit cells with jump 1 is compiled to rawmemchr, which nothing beats.
+template <typename Isa, CellType Cell> bool vectorPays(int jump) {
+	constexpr auto N = LANES<Isa, Cell>;
+	const auto j = std::abs(jump);
+	if (j == 0 || (sizeof(Cell) == 1 && jump == 1)) { return false; }
+	if (j >= LARGE_JUMP || j > N) {
+		return Isa::GATHER != 0 && (sizeof(Cell) == 1 || j < 64);
+	}
+	const auto isPowerOf2 = (j & (j - 1)) == 0;
+	return N >= (isPowerOf2 || sizeof(Cell) == 1 ? 2 : 4) * j;
+}
+
+template <typename Isa, CellType Cell>
+int vectorScan(std::span<const Cell> tape, int BASE, int jump) {
+	if (!vectorPays<Isa, Cell>(jump)) { return slowScan(tape, BASE, jump); }
+	// the mask rotation needs every vector to hold a full period of jump
+	if (std::abs(jump) >= LARGE_JUMP || std::abs(jump) > LANES<Isa, Cell>) {
+		if constexpr (Isa::GATHER != 0) {
+			return stridedScan<Isa>(tape, BASE, jump);
+		}
+		return slowScan(tape, BASE, jump);
+	}
+	auto isNeg = jump < 0;
+	if (isNeg) { jump = -jump; }
+	auto isPowerOf2 = (jump & (jump - 1)) == 0;
+
+	if (isPowerOf2) {
+		if (isNeg) {
+			return -fastScan<Isa, Cell, true, true>(tape, BASE, jump);
+		}
+		return fastScan<Isa, Cell, true, false>(tape, BASE, jump);
+	}
+	if (isNeg) { return -fastScan<Isa, Cell, false, true>(tape, BASE, jump); }
+	return fastScan<Isa, Cell, false, false>(tape, BASE, jump);
+}
+
+// Entry points of the kernels. Each one is compiled for its instruction set
+// with everything above inlined into it, so the rest of bfi can be built
+// for a baseline x86-64 and still pick the best kernel at runtime.
+template <CellType Cell>
+[[gnu::target("avx512bw"), gnu::flatten]] int scanAvx512(
+	std::span<const Cell> tape, int BASE, int jump) {
+	return vectorScan<isa::Avx512>(tape, BASE, jump);
+}
+
+template <CellType Cell>
+[[gnu::target("avx2"), gnu::flatten]] int scanAvx2(
+	std::span<const Cell> tape, int BASE, int jump) {
+	return vectorScan<isa::Avx2>(tape, BASE, jump);
+}
+
+template <CellType Cell>
+[[gnu::target("sse2"), gnu::flatten]] int scanSse2(
+	std::span<const Cell> tape, int BASE, int jump) {
+	return vectorScan<isa::Sse2>(tape, BASE, jump);
+}
+
+template <CellType Cell>
+int scanScalar(std::span<const Cell> tape, int BASE, int jump) {
+	return slowScan(tape, BASE, jump);
+}
+
+template <CellType Cell>
+using ScanKernel = int (*)(std::span<const Cell>, int, int);
+
+// Kernel for `isa`, with ISA::NATIVE resolved through cpuid
+template <CellType Cell> ScanKernel<Cell> scanKernel(ISA isa) {
+	switch (isa == ISA::NATIVE ? hostISA() : isa) {
+		case ISA::AVX512BW:
+			return scanAvx512<Cell>;
+		case ISA::AVX2:
+			return scanAvx2<Cell>;
+		case ISA::SSE2:
+			return scanSse2<Cell>;
+		case ISA::NATIVE:
+		case ISA::SCALAR:
+			break;
+	}
+	return scanScalar<Cell>;
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <fcntl.h>
+#include <immintrin.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+#include "util.hpp"
+
+// Text of a source file. Regular files are mapped read only and paged in as
+// the parser gets to them, anything else, like a pipe, is read into memory.
+class SourceFile {
+	const char* mapping = nullptr;
+	std::size_t length = 0;
+	std::string contents;
+	bool opened = false;
+
+   public:
+	explicit SourceFile(const std::filesystem::path& path) {
+		const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) { return; }
+		struct stat info {};
+		if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+			info.st_size > 0) {
+			const auto size = static_cast<std::size_t>(info.st_size);
+			void* m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (m != MAP_FAILED) {
+				madvise(m, size, MADV_SEQUENTIAL);
+				mapping = static_cast<const char*>(m);
+				length = size;
+			}
+		}
+		if (mapping == nullptr) {
+			std::array<char, 1 << 16> chunk;
+			auto n = ::read(fd, chunk.data(), chunk.size());
+			for (; n > 0; n = ::read(fd, chunk.data(), chunk.size())) {
+				contents.append(chunk.data(), n);
+			}
+			if (n < 0) {
+				::close(fd);
+				return;
+			}
+		}
+		::close(fd);
+		opened = true;
+	}
+	SourceFile(const SourceFile&) = delete;
+	SourceFile& operator=(const SourceFile&) = delete;
+	~SourceFile() {
+		if (mapping != nullptr) {
+			munmap(const_cast<char*>(mapping), length);
+		}
+	}
+
+	bool isOpen() const { return opened; }
+	std::string_view text() const {
+		return mapping != nullptr ? std::string_view(mapping, length)
+								  : std::string_view(contents);
+	}
+};
+
+// Bytes classified at once, one mask bit each
+constexpr std::size_t COMMAND_BLOCK = 64;
+
+// The nine command bytes +,-.<>[]$ are told from comments by their nibbles.
+// The high nibble of a byte picks one bit of COMMAND_HIGH, the low nibble the
+// bits of the high nibbles it makes a command with from COMMAND_LOW.
+constexpr std::array<std::uint8_t, 16> COMMAND_HIGH = {
+	0, 0, 1, 2, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+constexpr std::array<std::uint8_t, 16> COMMAND_LOW = {
+	0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 5, 3, 5, 3, 0};
+
+// `table` once for each 16 byte lane of an N byte vector, as byte shuffles
+// look up within their lane
+template <std::size_t N>
+constexpr std::array<std::uint8_t, N> perLane(
+	const std::array<std::uint8_t, 16>& table) {
+	std::array<std::uint8_t, N> r{};
+	for (auto k = 0u; k < N; ++k) { r[k] = table[k % 16]; }
+	return r;
+}
+
+constexpr bool isCommand(char ch) {
+	const auto byte = static_cast<std::uint8_t>(ch);
+	return (COMMAND_HIGH[byte >> 4] & COMMAND_LOW[byte & 15]) != 0;
+}
+
+// Every kernel returns the mask of the command bytes among the
+// COMMAND_BLOCK bytes at p, bit k for byte k
+using CommandKernel = std::uint64_t (*)(const char*);
+
+inline std::uint64_t commandsScalar(const char* p) {
+	std::uint64_t mask = 0;
+	for (auto k = 0u; k < COMMAND_BLOCK; ++k) {
+		mask |= static_cast<std::uint64_t>(isCommand(p[k])) << k;
+	}
+	return mask;
+}
+
+[[gnu::target("avx512bw")]] inline std::uint64_t commandsAvx512(
+	const char* p) {
+	static constexpr auto HIGH = perLane<64>(COMMAND_HIGH);
+	static constexpr auto LOW = perLane<64>(COMMAND_LOW);
+	const auto high = _mm512_loadu_si512(HIGH.data());
+	const auto low = _mm512_loadu_si512(LOW.data());
+	const auto nibble = _mm512_set1_epi8(15);
+	const auto v = _mm512_loadu_si512(p);
+	const auto h = _mm512_shuffle_epi8(
+		high, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble));
+	const auto l = _mm512_shuffle_epi8(low, _mm512_and_si512(v, nibble));
+	return _mm512_test_epi8_mask(h, l);
+}
+
+[[gnu::target("avx2")]] inline std::uint64_t commandsAvx2(const char* p) {
+	static constexpr auto HIGH = perLane<32>(COMMAND_HIGH);
+	static constexpr auto LOW = perLane<32>(COMMAND_LOW);
+	const auto high =
+		_mm256_loadu_si256(reinterpret_cast<const __m256i*>(HIGH.data()));
+	const auto low =
+		_mm256_loadu_si256(reinterpret_cast<const __m256i*>(LOW.data()));
+	const auto nibble = _mm256_set1_epi8(15);
+	const auto zero = _mm256_setzero_si256();
+	std::uint64_t mask = 0;
+	for (auto k = 0u; k < COMMAND_BLOCK; k += 32) {
+		const auto v =
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + k));
+		const auto h = _mm256_shuffle_epi8(
+			high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		const auto l = _mm256_shuffle_epi8(low, _mm256_and_si256(v, nibble));
+		const auto comment = _mm256_cmpeq_epi8(_mm256_and_si256(h, l), zero);
+		mask |= static_cast<std::uint64_t>(static_cast<std::uint32_t>(
+					~_mm256_movemask_epi8(comment)))
+				<< k;
+	}
+	return mask;
+}
+
+// no byte shuffles before SSSE3, every command is compared for
+[[gnu::target("sse2")]] inline std::uint64_t commandsSse2(const char* p) {
+	std::uint64_t mask = 0;
+	for (auto k = 0u; k < COMMAND_BLOCK; k += 16) {
+		const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + k));
+		auto hit = _mm_setzero_si128();
+		for (auto ch : std::string_view("+,-.<>[]$")) {
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(ch)));
+		}
+		mask |= static_cast<std::uint64_t>(_mm_movemask_epi8(hit)) << k;
+	}
+	return mask;
+}
+
+inline CommandKernel commandKernel(ISA isa) {
+	switch (isa == ISA::NATIVE ? hostISA() : isa) {
+		case ISA::AVX512BW:
+			return commandsAvx512;
+		case ISA::AVX2:
+			return commandsAvx2;
+		case ISA::SSE2:
+			return commandsSse2;
+		case ISA::NATIVE:
+		case ISA::SCALAR:
+			break;
+	}
+	return commandsScalar;
+}
+
+// Offsets of the command bytes of a text in order. The text is classified a
+// block at a time, the mask of the block last looked at is kept.
+class CommandScanner {
+	std::string_view text;
+	CommandKernel kernel;
+	std::size_t block = std::string_view::npos;
+	std::uint64_t mask = 0;
+
+   public:
+	CommandScanner(std::string_view text, ISA isa)
+		: text(text), kernel(commandKernel(isa)) {}
+
+	// Offset of the first command byte at or after `pos`, the size of the
+	// text if there is none
+	std::size_t next(std::size_t pos) {
+		while (pos < text.size()) {
+			const auto base = pos - pos % COMMAND_BLOCK;
+			if (base != block) {
+				block = base;
+				if (base + COMMAND_BLOCK <= text.size()) {
+					mask = kernel(text.data() + base);
+				} else {
+					// the last block is padded with zeros, which are comments
+					std::array<char, COMMAND_BLOCK> tail{};
+					std::copy(text.begin() + base, text.end(), tail.begin());
+					mask = kernel(tail.data());
+				}
+			}
+			if (const auto rest = mask >> (pos - base); rest != 0) {
+				return pos + std::countr_zero(rest);
+			}
+			pos = base + COMMAND_BLOCK;
+		}
+		return text.size();
+	}
+};
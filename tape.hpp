@@ -0,0 +1,85 @@
+#pragma once
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <new>
+#include <span>
+#include <string_view>
+
+#include "io.hpp"
+#include "parser.hpp"
+
+// Cells reserved for the tape, the pointer starts in the middle. Pages are
+// only backed by memory once touched, so this costs address space only.
+constexpr std::size_t TAPE_LENGTH = 1ull << 30;
+// Inaccessible bytes mapped on both sides of the tape, any access landing
+// in them is reported as the pointer running off the tape
+constexpr std::size_t GUARD_LENGTH = 1ull << 20;
+// Bytes mapped for a tape of `Cell` including both guards
+template <CellType Cell>
+constexpr std::size_t TAPE_MAPPING =
+	TAPE_LENGTH * sizeof(Cell) + 2 * GUARD_LENGTH;
+// Message bfi and the code generated by bfc print on such an access
+constexpr std::string_view OUT_OF_BOUNDS = "tape pointer out of bounds";
+
+// Tape of bfi, a private anonymous mapping of TAPE_LENGTH lazily zeroed
+// cells between two PROT_NONE guards. Faults inside a guard write out what
+// is left in `out` and end the program with OUT_OF_BOUNDS, anything else
+// keeps the default SIGSEGV behaviour.
+template <CellType Cell> class Tape {
+	static constexpr auto BYTES = TAPE_LENGTH * sizeof(Cell);
+	static constexpr auto MAPPING = TAPE_MAPPING<Cell>;
+
+	static inline const char* mapping = nullptr;
+	static inline OutputBuffer* output = nullptr;
+
+	std::byte* base;
+
+	static void onFault(int sig, siginfo_t* info, void*) {
+		const auto* addr = static_cast<const char*>(info->si_addr);
+		const auto inLowGuard =
+			addr >= mapping && addr < mapping + GUARD_LENGTH;
+		const auto inHighGuard =
+			addr >= mapping + GUARD_LENGTH + BYTES && addr < mapping + MAPPING;
+		if (inLowGuard || inHighGuard) {
+			// only write(2) underneath, safe to call from the handler
+			output->flush();
+			auto n = ::write(
+				STDERR_FILENO, OUT_OF_BOUNDS.data(), OUT_OF_BOUNDS.size());
+			n = ::write(STDERR_FILENO, "\n", 1);
+			static_cast<void>(n);
+			_exit(1);
+		}
+		// not ours, fault again with the default action
+		signal(sig, SIG_DFL);
+	}
+
+   public:
+	explicit Tape(OutputBuffer& out) {
+		void* m = mmap(
+			nullptr, MAPPING, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (m == MAP_FAILED) { throw std::bad_alloc(); }
+		base = static_cast<std::byte*>(m);
+		mprotect(base, GUARD_LENGTH, PROT_NONE);
+		mprotect(base + GUARD_LENGTH + BYTES, GUARD_LENGTH, PROT_NONE);
+
+		mapping = reinterpret_cast<const char*>(base);
+		output = &out;
+		struct sigaction action {};
+		action.sa_sigaction = onFault;
+		action.sa_flags = SA_SIGINFO;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, nullptr);
+	}
+	Tape(const Tape&) = delete;
+	Tape& operator=(const Tape&) = delete;
+	~Tape() { munmap(base, MAPPING); }
+
+	std::span<Cell> cells() {
+		return {reinterpret_cast<Cell*>(base + GUARD_LENGTH), TAPE_LENGTH};
+	}
+};
@@ -1,7 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <exception>
 #include <filesystem>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 template <typename S> inline void print(S& s, std::string_view fmt) {
@@ -25,14 +35,46 @@ void print(S& s, std::string_view fmt, const T& t, Args... args) {
 #define debug(FMT, ...) \
 	print(std::cerr, "%:%: " FMT, __FILE__, __LINE__, __VA_ARGS__)
 
+// What READ stores once the input is exhausted
+enum class EOFPolicy { UNCHANGED, ZERO, MINUS_ONE };
+
+// Instruction set SCAN and the parser are vectorized with, NATIVE stands for
+// the best one the running machine supports
+enum class ISA { NATIVE, AVX512BW, AVX2, SSE2, SCALAR };
+
+inline ISA hostISA() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw")) { return ISA::AVX512BW; }
+	if (__builtin_cpu_supports("avx2")) { return ISA::AVX2; }
+	if (__builtin_cpu_supports("sse2")) { return ISA::SSE2; }
+	return ISA::SCALAR;
+}
+
+// Backend solving the linear systems of the loop linearizer, MODULAR works
+// modulo a word sized prime and falls back to the exact BAREISS
+enum class Solver { MODULAR, BAREISS };
+
 struct Args {
 	std::filesystem::path input;
 	std::filesystem::path output;
+	std::filesystem::path linearCache;
 	bool profile = false;
 	bool optimizeSimpleLoops = true;
 	bool optimizeScans = true;
+	bool optimizeSweeps = true;
 	bool linearizeLoops = true;
+	bool evaluatePrefix = true;
+	bool eliminateDeadCode = true;
+	bool eliminatePointerMoves = true;
+	bool fuseBlocks = true;
 	bool useLLVM = true;
+	bool threadedDispatch = true;
+	bool bufferedOutput = true;
+	EOFPolicy eof = EOFPolicy::MINUS_ONE;
+	int cellWidth = 8;
+	ISA isa = ISA::NATIVE;
+	Solver solver = Solver::MODULAR;
+	unsigned jobs = 0;	// 0 for one per core
 };
 
 Args argparse(int argc, char* argv[]) {
@@ -48,10 +90,81 @@ Args argparse(int argc, char* argv[]) {
 			a.optimizeSimpleLoops = false;
 		} else if (arg == "--no-scan-optimize") {
 			a.optimizeScans = false;
+		} else if (arg == "--no-sweep-optimize") {
+			a.optimizeSweeps = false;
 		} else if (arg == "--no-linearize-loop-optimize") {
 			a.linearizeLoops = false;
+		} else if (arg == "--no-prefix-optimize") {
+			a.evaluatePrefix = false;
+		} else if (arg == "--no-dead-code-optimize") {
+			a.eliminateDeadCode = false;
+		} else if (arg == "--no-offset-optimize") {
+			a.eliminatePointerMoves = false;
+		} else if (arg == "--no-block-optimize") {
+			a.fuseBlocks = false;
 		} else if (arg == "--no-llvm") {
 			a.useLLVM = false;
+		} else if (arg == "--no-threaded-dispatch") {
+			a.threadedDispatch = false;
+		} else if (arg == "--unbuffered") {
+			a.bufferedOutput = false;
+		} else if (arg.starts_with("--eof=")) {
+			auto policy = arg.substr(6);
+			if (policy == "unchanged") {
+				a.eof = EOFPolicy::UNCHANGED;
+			} else if (policy == "0") {
+				a.eof = EOFPolicy::ZERO;
+			} else if (policy == "-1") {
+				a.eof = EOFPolicy::MINUS_ONE;
+			} else {
+				print(std::cerr, "Unknown EOF policy '%'", policy);
+				std::exit(1);
+			}
+		} else if (arg.starts_with("--linear-cache=")) {
+			a.linearCache = arg.substr(15);
+		} else if (arg.starts_with("--cell-width=")) {
+			auto width = arg.substr(13);
+			if (width == "8" || width == "16" || width == "32") {
+				a.cellWidth = std::stoi(width);
+			} else {
+				print(std::cerr, "Unsupported cell width '%'", width);
+				std::exit(1);
+			}
+		} else if (arg.starts_with("--isa=")) {
+			auto isa = arg.substr(6);
+			if (isa == "native") {
+				a.isa = ISA::NATIVE;
+			} else if (isa == "avx512bw") {
+				a.isa = ISA::AVX512BW;
+			} else if (isa == "avx2") {
+				a.isa = ISA::AVX2;
+			} else if (isa == "sse2") {
+				a.isa = ISA::SSE2;
+			} else if (isa == "scalar") {
+				a.isa = ISA::SCALAR;
+			} else {
+				print(std::cerr, "Unknown instruction set '%'", isa);
+				std::exit(1);
+			}
+		} else if (arg.starts_with("--jobs=")) {
+			auto jobs = arg.substr(7);
+			auto digit = [](unsigned char c) { return std::isdigit(c) != 0; };
+			if (jobs.empty() || jobs.size() > 4 ||
+				!std::ranges::all_of(jobs, digit)) {
+				print(std::cerr, "Invalid number of jobs '%'", jobs);
+				std::exit(1);
+			}
+			a.jobs = std::stoi(jobs);
+		} else if (arg.starts_with("--solver=")) {
+			auto solver = arg.substr(9);
+			if (solver == "modular") {
+				a.solver = Solver::MODULAR;
+			} else if (solver == "bareiss") {
+				a.solver = Solver::BAREISS;
+			} else {
+				print(std::cerr, "Unknown solver '%'", solver);
+				std::exit(1);
+			}
 		} else if (a.input.empty()) {
 			a.input = arg;
 		}
@@ -71,3 +184,39 @@ template <typename T> T revBits(T v) {
 	r <<= s;
 	return r;
 }
+
+// Calls `f` with every index below `n`, on up to `jobs` threads (0 for one
+// per core) taking the next index as they are done with one. There are no
+// more threads than `n / grain`, so that small batches stay on the calling
+// thread. The first exception thrown by `f` is thrown again once all threads
+// are done.
+inline void parallelFor(
+	std::size_t n, unsigned jobs, std::size_t grain,
+	const std::function<void(std::size_t)>& f) {
+	if (jobs == 0) { jobs = std::max(1u, std::thread::hardware_concurrency()); }
+	const auto threads = std::min<std::size_t>(jobs, n / grain);
+	if (threads <= 1) {
+		for (auto i = 0u; i < n; ++i) { f(i); }
+		return;
+	}
+
+	std::atomic<std::size_t> next = 0;
+	std::exception_ptr error;
+	std::mutex errorLock;
+	auto work = [&] {
+		for (auto i = next++; i < n; i = next++) {
+			try {
+				f(i);
+			} catch (...) {
+				std::scoped_lock guard(errorLock);
+				if (!error) { error = std::current_exception(); }
+				next = n;
+			}
+		}
+	};
+	std::vector<std::thread> pool;
+	for (auto t = 1u; t < threads; ++t) { pool.emplace_back(work); }
+	work();
+	for (auto& t : pool) { t.join(); }
+	if (error) { std::rethrow_exception(error); }
+}
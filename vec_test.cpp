@@ -1,195 +1,260 @@
-#include <immintrin.h>
+// Benchmark of the SCAN kernels against the scalar loop and the unaligned
+// kernels they replaced
+// g++ -std=c++20 -O3 vec_test.cpp -lgmpxx -lgmp && ./a.out
 
-#include <bitset>
+#include <algorithm>
 #include <chrono>
-#include <cstring>
+#include <cstdint>
 #include <iostream>
-#include <random>
+#include <string_view>
+#include <vector>
 
+#include "scan.hpp"
 #include "util.hpp"
 
-using DATA_TYPE = unsigned char;
-
-int slowScan(const std::vector<DATA_TYPE>& tape, int BASE, int jump) {
-	for (auto i = 0;; i += jump) {
-		if (tape[i + BASE] == 0) { return i; }
-	}
-	return -1;
-}
-
-using VEC = __m512i;
-constexpr auto VEC_SZ = sizeof(VEC) / sizeof(DATA_TYPE);
+struct Kernel {
+	std::string_view name;
+	ISA isa;
+};
+
+constexpr Kernel KERNELS[] = {
+	{"avx512bw", ISA::AVX512BW},
+	{"avx2", ISA::AVX2},
+	{"sse2", ISA::SSE2},
+};
+
+// Kernels as they were before loads were aligned, the current ones have to
+// keep up with them. Vectors are read unaligned from BASE on, and the tape
+// is assumed to hold a zero in the direction of the scan.
+namespace reference {
+	template <typename Isa> struct Unaligned;
+
+	template <> struct Unaligned<isa::Avx512> : isa::Avx512 {
+		template <CellType Cell>
+		[[gnu::target("avx512bw")]] static std::uint64_t zeros(
+			const Cell* p) {
+			const auto v = _mm512_loadu_si512(p);
+			const auto zero = _mm512_setzero_si512();
+			if constexpr (sizeof(Cell) == 1) {
+				return _mm512_cmpeq_epi8_mask(v, zero);
+			} else if constexpr (sizeof(Cell) == 2) {
+				return _mm512_cmpeq_epi16_mask(v, zero);
+			} else {
+				return _mm512_cmpeq_epi32_mask(v, zero);
+			}
+		}
+	};
+
+	template <> struct Unaligned<isa::Avx2> : isa::Avx2 {
+		template <CellType Cell>
+		[[gnu::target("avx2")]] static std::uint64_t zeros(const Cell* p) {
+			const auto v =
+				_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+			const auto zero = _mm256_setzero_si256();
+			if constexpr (sizeof(Cell) == 1) {
+				return static_cast<std::uint32_t>(
+					_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+			} else if constexpr (sizeof(Cell) == 2) {
+				const auto eq = _mm256_cmpeq_epi16(v, zero);
+				const auto m = static_cast<std::uint32_t>(
+					_mm256_movemask_epi8(_mm256_packs_epi16(eq, eq)));
+				return (m & 0xFF) | ((m >> 8) & 0xFF00);
+			} else {
+				return static_cast<std::uint32_t>(_mm256_movemask_ps(
+					_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))));
+			}
+		}
+	};
+
+	template <> struct Unaligned<isa::Sse2> : isa::Sse2 {
+		template <CellType Cell>
+		[[gnu::target("sse2")]] static std::uint64_t zeros(const Cell* p) {
+			const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			const auto zero = _mm_setzero_si128();
+			if constexpr (sizeof(Cell) == 1) {
+				return static_cast<std::uint32_t>(
+					_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+			} else if constexpr (sizeof(Cell) == 2) {
+				const auto eq = _mm_cmpeq_epi16(v, zero);
+				return static_cast<std::uint32_t>(
+						   _mm_movemask_epi8(_mm_packs_epi16(eq, eq))) &
+					   0xFF;
+			} else {
+				return static_cast<std::uint32_t>(_mm_movemask_ps(
+					_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))));
+			}
+		}
+	};
 
-auto maskFromJump(int jump) {
-	__mmask64 m = 0;
-	for (auto i = 0u; i < VEC_SZ; i += jump) { m = m | 1ULL << i; }
-	return m;
-}
+	template <
+		typename Isa, CellType Cell, bool isPowerOf2, bool isJumpNegative>
+	int fastScan(std::span<const Cell> tape, int BASE, int jump) {
+		constexpr auto N = LANES<Isa, Cell>;
+		constexpr auto ALL = N == 64 ? ~0ULL : (1ULL << N) - 1;
+		auto i = 0;
+		const auto* ptr = &tape[BASE];
 
-auto maskToString(auto mask) {
-	auto str = std::bitset<VEC_SZ>(mask).to_string();
-	std::reverse(str.begin(), str.end());
-	return str;
-}
+		if constexpr (isJumpNegative) { ptr = &tape[BASE - N + 1]; }
 
-template <bool isPowerOf2, bool isJumpNegative>
-int fastScan(const std::vector<DATA_TYPE>& tape, int BASE, int jump) {
-	auto i = 0;
-	const auto* ptr = (const VEC*)(&tape[BASE]);
+		std::uint64_t mask = 0;
+		for (auto k = 0; k < N; k += jump) { mask = mask | 1ULL << k; }
+		int shift = 0;
 
-	if constexpr (isJumpNegative) {
-		ptr = (const VEC*)(&tape[BASE - VEC_SZ + 1]);
-	}
+		if constexpr (!isPowerOf2) { shift = jump - N % jump; }
+		if constexpr (isJumpNegative) { mask = revBits(mask) >> (64 - N); }
 
-	// generate a mask marking elements visited by jump
-	auto mask = maskFromJump(jump);
-	auto mask_mask = 0 * mask;
-	int shift = 0;
+		for (;; i += N) {
+			const auto eq = Unaligned<Isa>::zeros(ptr) & mask;
 
-	if constexpr (!isPowerOf2) {
-		// Below 2 are only used when powerOf2 is false;
-		// how much the mask shifts
-		shift = jump - static_cast<int>(VEC_SZ) % jump;
-		// used to update mask
-		mask_mask = (1 << (shift + 1)) - 1;
+			if (eq != 0) {
+				if constexpr (isJumpNegative) {
+					return std::countl_zero(eq) - (64 - N) + i;
+				}
+				return std::countr_zero(eq) + i;
+			}
 
-		// std::cout << "shift = " << shift << "\n";
-	}
-	if (isJumpNegative) {
-		mask = revBits(mask);
-		mask_mask = revBits(mask_mask);
+			if constexpr (!isPowerOf2) {
+				if constexpr (isJumpNegative) {
+					mask = ((mask >> shift) | (mask << (jump - shift))) & ALL;
+				} else {
+					mask = ((mask << shift) | (mask >> (jump - shift))) & ALL;
+				}
+			}
+			if constexpr (isJumpNegative) {
+				ptr -= N;
+			} else {
+				ptr += N;
+			}
+		}
+		return -1;
 	}
 
-	// value to test for
-	const VEC v_rhs = _mm512_setzero_si512();
-
-	for (;; i += VEC_SZ) {
-		// load VEC_SZ elements into a variable
-		auto v_lhs = _mm512_loadu_si512(ptr);
-		// result has its ith bit set if ith element == 0
-		auto v_eq = _mm512_mask_cmpeq_epi8_mask(mask, v_lhs, v_rhs);
-
-		// std::cout << std::setw(3) << i << " = " << maskToString(mask) <<
-		// "\n"; std::cout << std::setw(3) << i << " = " <<
-		// maskToString(mask_mask)
-		// << "\n";
-		// std::cout << "      " << maskToString(v_eq) << "\n";
-
-		if (v_eq != 0) {  // found something somewhere
-			// find the first/last set bit
-			if constexpr (isJumpNegative) { return std::countl_zero(v_eq) + i; }
-			return std::countr_zero(v_eq) + i;
+	template <typename Isa, CellType Cell>
+	int vectorScan(std::span<const Cell> tape, int BASE, int jump) {
+		if (jump == 0) {
+			if (tape[BASE] == 0) { return 0; }
 		}
+		if (std::abs(jump) >= LARGE_JUMP ||
+			std::abs(jump) > LANES<Isa, Cell>) {
+			if constexpr (Isa::GATHER != 0) {
+				return stridedScan<Isa>(tape, BASE, jump);
+			}
+			return slowScan(tape, BASE, jump);
+		}
+		auto isNeg = jump < 0;
+		if (isNeg) { jump = -jump; }
+		auto isPowerOf2 = (jump & (jump - 1)) == 0;
 
-		if constexpr (!isPowerOf2) {
-			if constexpr (isJumpNegative) {
-				mask = (mask >> shift) | (mask_mask & (mask << (jump - shift)));
-			} else {
-				mask = (mask << shift) | (mask_mask & (mask >> (jump - shift)));
+		if (isPowerOf2) {
+			if (isNeg) {
+				return -fastScan<Isa, Cell, true, true>(tape, BASE, jump);
 			}
+			return fastScan<Isa, Cell, true, false>(tape, BASE, jump);
 		}
-		if constexpr (isJumpNegative) {
-			ptr--;
-		} else {
-			ptr++;
+		if (isNeg) {
+			return -fastScan<Isa, Cell, false, true>(tape, BASE, jump);
 		}
+		return fastScan<Isa, Cell, false, false>(tape, BASE, jump);
 	}
-	return -1;
-}
 
-int scan(const std::vector<DATA_TYPE>& tape, int BASE, int jump) {
-	auto isNeg = jump < 0;
-	if (isNeg) { jump = -jump; }
-	auto isPowerOf2 = (jump & (jump - 1)) == 0;
+	template <CellType Cell>
+	[[gnu::target("avx512bw"), gnu::flatten]] int scanAvx512(
+		std::span<const Cell> tape, int BASE, int jump) {
+		return vectorScan<isa::Avx512>(tape, BASE, jump);
+	}
 
-	if (isPowerOf2) {
-		if (isNeg) { return -fastScan<true, true>(tape, BASE, jump); }
-		return fastScan<true, false>(tape, BASE, jump);
+	template <CellType Cell>
+	[[gnu::target("avx2"), gnu::flatten]] int scanAvx2(
+		std::span<const Cell> tape, int BASE, int jump) {
+		return vectorScan<isa::Avx2>(tape, BASE, jump);
 	}
-	if (isNeg) { return -fastScan<false, true>(tape, BASE, jump); }
-	return fastScan<false, false>(tape, BASE, jump);
-}
 
-int main() {
-	std::random_device rd;
-	std::mt19937 g(rd());
-	std::uniform_int_distribution<> d(100, 600);
-
-	auto start = std::chrono::high_resolution_clock::now();
-	auto end = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<double> diff = end - start;
-
-	double stime = 0, ftime = 0;
-
-	int a = 0, b = 0;
-
-	const auto REPEAT = 1000000;
-	const auto SIZE = 700;
-	const auto LOOP = 7;
-
-	auto n = d(g);
-	auto j = d(g) / 100;
-	n -= n % j;
-	// j = 3;
-	// n = 267;
-	for (auto i = 0; i < REPEAT; ++i) {
-		const auto BASE = SIZE - 1;
-		std::vector<DATA_TYPE> h(2 * SIZE - 1, 0);
-
-		for (auto i = 0; i < SIZE; ++i) {
-			if (i % j == 0) {
-				h[BASE + i] = i % LOOP + 1;
-			} else {
-				h[BASE + i] = 0;
-			}
-		}
-		for (auto i = 0; i < SIZE; ++i) {
-			if (i % j == 0) {
-				h[BASE - i] = i % LOOP + 1;
-			} else {
-				h[BASE - i] = 0;
-			}
+	template <CellType Cell>
+	[[gnu::target("sse2"), gnu::flatten]] int scanSse2(
+		std::span<const Cell> tape, int BASE, int jump) {
+		return vectorScan<isa::Sse2>(tape, BASE, jump);
+	}
+
+	template <CellType Cell> ScanKernel<Cell> scanKernel(ISA isa) {
+		switch (isa) {
+			case ISA::AVX512BW:
+				return scanAvx512<Cell>;
+			case ISA::AVX2:
+				return scanAvx2<Cell>;
+			default:
+				return scanSse2<Cell>;
 		}
-		h[BASE - n] = 0;
-
-		start = std::chrono::high_resolution_clock::now();
-		a = slowScan(h, BASE, -j);
-		end = std::chrono::high_resolution_clock::now();
-		diff = end - start;
-		stime += diff.count();
-
-		start = std::chrono::high_resolution_clock::now();
-		b = scan(h, BASE, -j);
-		end = std::chrono::high_resolution_clock::now();
-		diff = end - start;
-		ftime += diff.count();
-
-		if (a == b) { continue; }
-
-		print(std::cout, "n: %, j: %", n, j);
-		print(std::cout, "FAST FAIL: EXPECTED: % GOT: %", a, b);
-		for (auto i = 0; i < 2 * SIZE - 1;) {
-			if (i == (BASE + a)) { std::cout << "\x1B[32m"; }
-			if (i == (BASE + b)) { std::cout << "\x1B[31m"; }
-			if (i % j == 0) {
-				std::cout << "*";
-			} else {
-				std::cout << " ";
+	}
+}  // namespace reference
+
+// Best time in seconds of one scan of `jump` from BASE over TRIALS rounds of
+// REPEAT scans, the machine is rarely quiet enough for a single round
+template <CellType Cell>
+double timeScan(
+	ScanKernel<Cell> kernel, const std::vector<Cell>& h, int BASE, int jump,
+	int expected) {
+	constexpr auto TRIALS = 21;
+	constexpr auto REPEAT = 300;
+	// keeps the compiler from hoisting the scan out of the loop
+	volatile ScanKernel<Cell> scan = kernel;
+	auto best = 1e9;
+	for (auto t = 0; t < TRIALS; ++t) {
+		const auto start = std::chrono::high_resolution_clock::now();
+		for (auto r = 0; r < REPEAT; ++r) {
+			const auto got = scan(h, BASE, jump);
+			if (got != expected) {
+				print(std::cout, "FAIL: jump: %, EXPECTED: % GOT: %", jump,
+					  expected, got);
+				std::exit(1);
 			}
-			std::cout << std::setw(4) << i - BASE << "=" << (int)h[i] << ",";
-			if (i == (BASE + a)) { std::cout << "\033[0m"; }
-			if (i == (BASE + b)) { std::cout << "\033[0m"; }
-			i++;
-			if (i % 16 == 0) { std::cout << '\n'; }
 		}
-		std::cout << "\n";
-		break;
+		const std::chrono::duration<double> diff =
+			std::chrono::high_resolution_clock::now() - start;
+		best = std::min(best, diff.count() / REPEAT);
 	}
+	return best;
+}
 
-	print(
-		std::cout,
-		"Time a = %, j = %, n = %, slow: %s\tfast: %s\nSLOW/FAST = %", a, j, n,
-		stime, ftime, stime / ftime);
+template <CellType Cell> void bench(int jump) {
+	const auto SIZE = 1 << 16;
+	const auto BASE = SIZE;
+	const auto sign = jump < 0 ? -1 : 1;
+
+	// cells visited by the scan are nonzero up to a distance of n, the ones
+	// skipped over are zero to catch kernels looking at the wrong lanes
+	const auto n = SIZE / 2 - (SIZE / 2) % std::abs(jump);
+	std::vector<Cell> h(2 * SIZE, 0);
+	for (auto i = 0; i < n; i += std::abs(jump)) {
+		h[BASE + sign * i] = i % 7 + 1;
+	}
+	// bytes of tape swept per nanosecond
+	const auto rate = [&](double seconds) {
+		return n * sizeof(Cell) / seconds / 1e9;
+	};
+
+	const auto slow = timeScan<Cell>(
+		[](auto tape, auto base, auto j) { return slowScan(tape, base, j); }, h,
+		BASE, jump, sign * n);
+	for (const auto& k : KERNELS) {
+		if (hostISA() > k.isa) { continue; }
+		const auto old = timeScan(
+			reference::scanKernel<Cell>(k.isa), h, BASE, jump, sign * n);
+		const auto fast =
+			timeScan(scanKernel<Cell>(k.isa), h, BASE, jump, sign * n);
+		print(std::cout,
+			  "cell: %, jump: %, %: slow: %GB/s\told: %GB/s\tfast: %GB/s\t"
+			  "SLOW/FAST = %\tOLD/FAST = %",
+			  8 * sizeof(Cell), jump, k.name, rate(slow), rate(old),
+			  rate(fast), slow / fast, old / fast);
+	}
+}
 
+int main() {
+	for (const auto jump :
+		 {1, 2, 3, 4, 5, 8, 12, 16, 33, 64, -1, -3, -8, -33}) {
+		bench<std::uint8_t>(jump);
+		bench<std::uint16_t>(jump);
+		bench<std::uint32_t>(jump);
+	}
 	return 0;
 }